@@ -0,0 +1,172 @@
+/*
+ * Project: 12V DC Uninterruptable Power Supply
+ * File: adc.cpp
+ * Author: Thorin Hopkins (topy at untergrund dot net)
+ * Copyright: (C) 2014 by Thorin Hopkins
+ * License: GNU GPL v3 (see LICENSE.txt)
+ * Web: https://github.com/Topy44/ups
+ */ 
+
+#include <avr/io.h>
+
+#include "global.h"
+#include "pins.h"
+#include "adc.h"
+#include "battery.h"
+#include "stats.h"
+
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+#include "millis.h"
+
+struct adcsetting
+{
+	uint16_t interval;	// ms between bursts
+	uint8_t osbits;		// Extra bits by oversampling, takes 4^n samples per channel
+};
+
+static const adcsetting adcPolicies[ADC_POLICIES] PROGMEM =
+{
+	{ 1000, 1 },	// ADC_IDLE: 4 samples, once a second
+	{ 250, 1 },		// ADC_CHARGING: 4 samples
+	{ 50, 2 },		// ADC_BATTERY: 16 samples, 12 bit
+	{ 20, 3 },		// ADC_THRESHOLD: 64 samples, 13 bit
+	{ 10, 0 }		// ADC_TRANSITION: single samples, fast
+};
+
+static uint8_t adcChannels[BAT_CHANNELS];	// ADC inputs from BATCHANNELS
+
+static uint8_t adcPolicy = ADC_IDLE;
+static millis_t adcBurstTime = 0;
+
+// Shared with the ISR
+static volatile bool adcBusy = false;
+static volatile bool adcDone = false;
+static volatile uint8_t adcIndex;
+static volatile uint8_t adcCount;
+static volatile uint8_t adcBits;
+static volatile uint16_t adcSum;
+static volatile uint16_t adcResults[BAT_CHANNELS];
+
+static bool adcAborted;		// Burst interrupted by adc_suspend()
+
+void adc_init()
+{
+	for (uint8_t i = 0; i < BAT_CHANNELS; i++) adcChannels[i] = BATCHANNELS[i].adc;
+	ADMUX = 0;	// External voltage reference
+	ADCSRA = (1<<ADEN) | (1<<ADIE) | (1<<ADPS0) | (1<<ADPS1) | (1<<ADPS2);	// Enable ADC and interrupt, Prescaler F_CPU/128
+}
+
+void adc_setpolicy(uint8_t policy)
+{
+	adcPolicy = policy;
+}
+
+uint8_t adc_policy()
+{
+	return adcPolicy;
+}
+
+static void adc_start()
+{
+	// Start a burst over all channels
+	adcBits = pgm_read_byte(&adcPolicies[adcPolicy].osbits);
+	adcIndex = 0;
+	adcCount = 1 << (2 * adcBits);
+	adcSum = 0;
+	adcBusy = true;
+	ADMUX = adcChannels[0];
+	ADCSRA |= (1<<ADSC);
+}
+
+void adc_update()
+{
+	if (adcBusy) return;
+
+	millis_t now = millis();
+	if (now - adcBurstTime >= pgm_read_word(&adcPolicies[adcPolicy].interval))
+	{
+		adcBurstTime = now;
+		adc_start();
+	}
+}
+
+bool adc_ready()
+{
+	// True once per completed burst
+	if (!adcDone) return false;
+	adcDone = false;
+	return true;
+}
+
+void adc_wait()
+{
+	// Take a fresh set of samples right now
+	while (adcBusy);
+	adcBurstTime = millis();
+	adc_start();
+	while (adcBusy);
+	adcDone = false;
+}
+
+void adc_results(uint16_t *results)
+{
+	// Copy of the last complete set, one per channel
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		for (uint8_t i = 0; i < BAT_CHANNELS; i++) results[i] = adcResults[i];
+	}
+}
+
+void adc_suspend()
+{
+	// Call with interrupts off, until adc_resume()
+	ADCSRA &= ~(1<<ADIE);
+	while (ADCSRA & (1<<ADSC));
+	adcAborted = adcBusy;
+	adcBusy = false;
+}
+
+uint16_t adc_probe(uint8_t channel)
+{
+	// Single 10 bit conversion, about 104us
+	ADMUX = channel;
+	ADCSRA |= (1<<ADSC);
+	while (ADCSRA & (1<<ADSC));
+	return ADC;
+}
+
+void adc_resume()
+{
+	ADCSRA |= (1<<ADIF) | (1<<ADIE);	// Drop the flag of the last probe
+	if (adcAborted) adc_start();
+}
+
+ISR(ADC_vect)
+{
+	adcSum += ADC;
+	if (--adcCount)
+	{
+		ADCSRA |= (1<<ADSC);
+		return;
+	}
+
+	// Channel done, scale sum of 4^n samples to 1/16 LSB
+	uint8_t bits = adcBits;
+	adcResults[adcIndex] = (2 * bits >= 4) ? adcSum >> (2 * bits - 4) : adcSum << (4 - 2 * bits);
+
+	if (++adcIndex < BAT_CHANNELS)
+	{
+		adcCount = 1 << (2 * bits);
+		adcSum = 0;
+		ADMUX = adcChannels[adcIndex];
+		ADCSRA |= (1<<ADSC);
+	}
+	else
+	{
+		adcBusy = false;
+		adcDone = true;
+		stats_sample((const uint16_t *)adcResults);	// Not changing while in here
+	}
+}
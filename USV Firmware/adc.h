@@ -0,0 +1,46 @@
+/*
+ * Project: 12V DC Uninterruptable Power Supply
+ * File: adc.h
+ * Author: Thorin Hopkins (topy at untergrund dot net)
+ * Copyright: (C) 2014 by Thorin Hopkins
+ * License: GNU GPL v3 (see LICENSE.txt)
+ * Web: https://github.com/Topy44/ups
+ */ 
+
+
+#ifndef ADC_H_
+#define ADC_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Interrupt driven battery voltage sampling. Every interval a burst of oversampled conversions
+// runs over all channels in the background. Interval and oversampling depth come from the
+// sampling policy the main loop picks for the current operating state. One channel per battery
+// (see BATCHANNELS in battery.h). With interrupts off, adc_suspend() hands the ADC over for
+// single polled conversions (relay settle detection), a burst in progress is started over.
+
+// -- Sampling policies
+#define ADC_IDLE 0			// Ext. power, batteries not charging
+#define ADC_CHARGING 1
+#define ADC_BATTERY 2		// Bat. power
+#define ADC_THRESHOLD 3		// Bat. power, close to a voltage threshold
+#define ADC_TRANSITION 4	// Power or switch state just changed
+#define ADC_POLICIES 5
+
+// Results are scaled to 1/16 LSB of a single 10 bit conversion (0 - 16368)
+#define ADC_SCALE 16
+
+// -- Prototypes
+void adc_init();
+void adc_setpolicy(uint8_t policy);
+uint8_t adc_policy();
+void adc_update();
+bool adc_ready();
+void adc_wait();
+void adc_results(uint16_t *results);
+void adc_suspend();
+uint16_t adc_probe(uint8_t channel);
+void adc_resume();
+
+#endif /* ADC_H_ */
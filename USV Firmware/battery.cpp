@@ -0,0 +1,102 @@
+/*
+ * Project: 12V DC Uninterruptable Power Supply
+ * File: battery.cpp
+ * Author: Thorin Hopkins (topy at untergrund dot net)
+ * Copyright: (C) 2014 by Thorin Hopkins
+ * License: GNU GPL v3 (see LICENSE.txt)
+ * Web: https://github.com/Topy44/ups
+ */ 
+
+#include <avr/io.h>
+
+#include "pins.h"
+#include "battery.h"
+#include "adc.h"
+#include "iomacros.h"
+
+#include <avr/pgmspace.h>
+
+// Pack voltages for the SoC table, folded from the selected profile
+#define SOCPOINT(i) (uint16_t)(BATTERY.cells * BATTERY.chem.soc[i])
+
+static const uint16_t socTable[BAT_SOCPOINTS] PROGMEM =
+{
+	SOCPOINT(0), SOCPOINT(1), SOCPOINT(2), SOCPOINT(3), SOCPOINT(4), SOCPOINT(5),
+	SOCPOINT(6), SOCPOINT(7), SOCPOINT(8), SOCPOINT(9), SOCPOINT(10)
+};
+
+uint8_t bat_soc(int16_t mv)
+{
+	// State of charge in percent, interpolated between table points
+	if (mv <= BATSHUTOFF) return 0;
+	if (mv >= BATMAX) return 100;
+
+	uint8_t i = 1;
+	uint16_t hi = pgm_read_word(&socTable[1]);
+	while ((uint16_t)mv >= hi)
+	{
+		i++;
+		hi = pgm_read_word(&socTable[i]);
+	}
+	uint16_t lo = pgm_read_word(&socTable[i-1]);
+	return (i-1)*10 + (uint8_t)(((uint16_t)mv - lo) * 10UL / (hi - lo));
+}
+
+uint16_t bat_mv(uint16_t result, uint16_t range)
+{
+	// Convert a scaled ADC result to mV at the battery
+	return (uint32_t)result * range / (1024UL*ADC_SCALE);
+}
+
+void bat_convert(const uint16_t *results, int16_t *mv)
+{
+	// Battery voltages from all ADC inputs. Main loop only, the ISR keeps raw values (stats_sample())
+	uint16_t tap[BAT_CHANNELS];		// Stack voltages can exceed 32V
+	for (uint8_t i = 0; i < BAT_CHANNELS; i++) tap[i] = bat_mv(results[i], bat_range(i));
+
+	// Without the charger each input sees the batteries below as well
+	bool stacked = !get(CHARGESEL);
+	for (uint8_t i = 0; i < BAT_CHANNELS; i++)
+	{
+		uint8_t below = BATCHANNELS[i].below;
+		mv[i] = stacked && below != BAT_BOTTOM ? tap[i] - tap[below] : tap[i];
+	}
+}
+
+int16_t bat_lowest(const int16_t *mv)
+{
+	int16_t lowest = mv[0];
+	for (uint8_t i = 1; i < BAT_CHANNELS; i++) if (mv[i] < lowest) lowest = mv[i];
+	return lowest;
+}
+
+static volatile uint8_t *batport(char port, uint8_t reg)
+{
+	// reg: 0 = PINx, 1 = DDRx, 2 = PORTx (consecutive on the ATmega328P)
+	volatile uint8_t *pin = port == 'B' ? &PINB : port == 'C' ? &PINC : &PIND;
+	return pin + reg;
+}
+
+void bat_init()
+{
+	// Charger status inputs with pullups
+	for (uint8_t i = 0; i < BAT_CHANNELS; i++)
+	{
+		*batport(BATCHANNELS[i].statport, 1) &= ~(1 << BATCHANNELS[i].statbit);
+		*batport(BATCHANNELS[i].statport, 2) |= 1 << BATCHANNELS[i].statbit;
+	}
+}
+
+bool bat_charging(uint8_t ch)
+{
+	// Charger status inputs are low while charging
+	return !(*batport(BATCHANNELS[ch].statport, 0) & (1 << BATCHANNELS[ch].statbit));
+}
+
+uint8_t bat_chargemask()
+{
+	// Bit n set while battery n+1 is charging
+	uint8_t mask = 0;
+	for (uint8_t i = 0; i < BAT_CHANNELS; i++) if (bat_charging(i)) mask |= 1 << i;
+	return mask;
+}
@@ -0,0 +1,143 @@
+/*
+ * Project: 12V DC Uninterruptable Power Supply
+ * File: battery.h
+ * Author: Thorin Hopkins (topy at untergrund dot net)
+ * Copyright: (C) 2014 by Thorin Hopkins
+ * License: GNU GPL v3 (see LICENSE.txt)
+ * Web: https://github.com/Topy44/ups
+ */ 
+
+
+#ifndef BATTERY_H_
+#define BATTERY_H_
+
+#include <stdint.h>
+#include "usvfirmware.h"
+#include "pins.h"
+
+// Battery chemistry and pack profiles. All thresholds are derived from the selected profile at
+// compile time and end up as integer constants in mV, so picking a profile costs no RAM or cycles.
+// Profiles that don't fit the hardware (dividers, ADC range) or are inconsistent don't compile.
+// Select with -DBATPROFILE=BAT_xxx.
+
+#define BAT_SOCPOINTS 11	// Resting cell voltage at 0, 10 .. 100% charge
+
+// Per cell values in mV
+struct chemistry
+{
+	uint16_t full;		// Charged, resting
+	uint16_t low;		// Low warning
+	uint16_t verylow;	// Very low warning
+	uint16_t shutoff;	// Discharged, output is turned off
+	uint16_t hysteresis;	// Warnings clear X above their threshold
+	uint16_t chargerise;	// Slowest rise while charging below full that still counts as progress (mV/h)
+	uint16_t soc[BAT_SOCPOINTS];
+};
+
+struct batprofile
+{
+	chemistry chem;
+	uint8_t cells;
+};
+
+// -- Chemistries
+constexpr chemistry CHEM_LIPO = { 4075, 3500, 3450, 3400, 50, 12, { 3400, 3690, 3730, 3770, 3790, 3820, 3870, 3930, 3990, 4040, 4075 } };
+constexpr chemistry CHEM_LIFEPO4 = { 3350, 3150, 3100, 3000, 50, 4, { 3000, 3200, 3220, 3240, 3260, 3270, 3280, 3290, 3300, 3320, 3350 } };
+constexpr chemistry CHEM_LEADACID = { 2120, 1950, 1920, 1870, 25, 8, { 1870, 1930, 1960, 1990, 2010, 2030, 2050, 2070, 2090, 2110, 2120 } };
+
+// -- Packs (per battery, BAT_CHANNELS batteries in series)
+constexpr batprofile BAT_LIPO2S = { CHEM_LIPO, 2 };
+constexpr batprofile BAT_LIPO3S = { CHEM_LIPO, 3 };	// Needs larger dividers
+constexpr batprofile BAT_LIFEPO4_2S = { CHEM_LIFEPO4, 2 };
+constexpr batprofile BAT_LIFEPO4_3S = { CHEM_LIFEPO4, 3 };	// Needs larger dividers
+constexpr batprofile BAT_LEADACID_6V = { CHEM_LEADACID, 3 };
+
+#ifndef BATPROFILE
+	#define BATPROFILE BAT_LIPO2S
+#endif
+
+constexpr batprofile BATTERY = BATPROFILE;
+
+// -- Derived values, mV per battery
+constexpr int16_t BATMAX = BATTERY.cells * BATTERY.chem.full;
+constexpr int16_t BATLOWV = BATTERY.cells * BATTERY.chem.low;
+constexpr int16_t BATVLOWV = BATTERY.cells * BATTERY.chem.verylow;
+constexpr int16_t BATSHUTOFF = BATTERY.cells * BATTERY.chem.shutoff;
+constexpr int16_t BATHYST = BATTERY.cells * BATTERY.chem.hysteresis;
+constexpr int16_t BATCHGRISE = BATTERY.cells * BATTERY.chem.chargerise;	// mV/h
+
+// -- Channels
+// One per battery, top of the stack first. With the charger relay off the batteries are in series
+// and each input sees the stack from ground up to its battery, so the input of the battery below
+// is subtracted. With the charger on every battery is measured on its own. Loops over the
+// channels use the constants below and get unrolled for small counts.
+#define BAT_BOTTOM 0xFF		// No battery below
+#define BATSTAT(pin) _batstat(pin)
+#define _batstat(bit,port) bit, #port[0]
+
+// ADC full scale in mV for an input voltage divider ratio. Only for the table below, the ratio
+// is a double and must not end up in code.
+constexpr uint16_t bat_fullscale(double divider)
+{
+	return VREF*1000*divider;
+}
+
+struct batchannel
+{
+	uint8_t adc;		// ADC input
+	uint16_t range;		// ADC full scale in mV at the input, bat_fullscale(divider ratio)
+	uint8_t below;		// Channel of the next battery down the stack
+	uint8_t statbit;	// Charger status input (active low), see BATSTAT()
+	char statport;
+};
+
+constexpr batchannel BATCHANNELS[] =
+{
+	{ BAT1V, bat_fullscale(VDIV1), 1, BATSTAT(BAT1STAT) },
+	{ BAT2V, bat_fullscale(VDIV2), BAT_BOTTOM, BATSTAT(BAT2STAT) }
+};
+
+constexpr uint8_t BAT_CHANNELS = sizeof(BATCHANNELS) / sizeof(BATCHANNELS[0]);
+
+// ADC full scale in mV of a channel's input
+constexpr uint16_t bat_range(uint8_t ch)
+{
+	return BATCHANNELS[ch].range;
+}
+
+// Batteries from ground up to and including this one
+constexpr uint8_t bat_depth(uint8_t ch)
+{
+	return BATCHANNELS[ch].below == BAT_BOTTOM ? 1 : 1 + bat_depth(BATCHANNELS[ch].below);
+}
+
+constexpr bool bat_channelsok(uint8_t ch)
+{
+	return ch == BAT_CHANNELS || ((BATCHANNELS[ch].below == BAT_BOTTOM || BATCHANNELS[ch].below < BAT_CHANNELS) &&
+		(uint32_t)bat_depth(ch) * BATMAX <= bat_range(ch) && bat_channelsok(ch + 1));
+}
+
+constexpr bool bat_rising(const uint16_t *table, uint8_t n)
+{
+	return n < 2 || (table[0] < table[1] && bat_rising(table + 1, n - 1));
+}
+
+static_assert(BATTERY.cells > 0, "Battery profile needs at least one cell");
+static_assert(BATTERY.chem.shutoff < BATTERY.chem.verylow && BATTERY.chem.verylow < BATTERY.chem.low && BATTERY.chem.low < BATTERY.chem.full, "Chemistry thresholds have to be shutoff < very low < low < full");
+static_assert(BATTERY.chem.hysteresis > 0 && BATTERY.chem.low + BATTERY.chem.hysteresis < BATTERY.chem.full, "Chemistry hysteresis out of range");
+static_assert(BATTERY.chem.soc[0] == BATTERY.chem.shutoff && BATTERY.chem.soc[BAT_SOCPOINTS-1] == BATTERY.chem.full, "SoC table has to span shutoff to full");
+static_assert(bat_rising(BATTERY.chem.soc, BAT_SOCPOINTS), "SoC table has to be strictly rising");
+static_assert(BAT_CHANNELS > 0, "Needs at least one battery channel");
+static_assert(bat_channelsok(0), "Battery channel dividers can't measure their part of the stack, or bad stack order");
+static_assert(BATTERY.chem.chargerise > 0, "Chemistry needs a minimum charge rise");
+
+// -- Prototypes
+uint8_t bat_soc(int16_t mv);
+uint16_t bat_mv(uint16_t result, uint16_t range);
+void bat_convert(const uint16_t *results, int16_t *mv);
+int16_t bat_lowest(const int16_t *mv);
+void bat_init();
+bool bat_charging(uint8_t ch);
+uint8_t bat_chargemask();
+
+#endif /* BATTERY_H_ */
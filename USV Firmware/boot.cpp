@@ -0,0 +1,85 @@
+/*
+ * Project: 12V DC Uninterruptable Power Supply
+ * File: boot.cpp
+ * Author: Thorin Hopkins (topy at untergrund dot net)
+ * Copyright: (C) 2014 by Thorin Hopkins
+ * License: GNU GPL v3 (see LICENSE.txt)
+ * Web: https://github.com/Topy44/ups
+ */ 
+
+#include <avr/io.h>
+
+#include "global.h"
+#include "pins.h"
+#include "boot.h"
+
+#include <util/delay.h>
+#include <avr/pgmspace.h>
+#include <stdio.h>
+#include "iomacros.h"
+#include "millis.h"
+
+// .noinit, .bss gets cleared after boot_protect() ran
+static uint16_t bootTicks[BOOT_PHASES] __attribute__((section(".noinit")));
+static millis_t bootLoopTime = 0;
+
+void boot_protect() __attribute__((naked, used, section(".init1")));
+void boot_protect()
+{
+	asm volatile ("clr r1");	// Zero register is only set up in .init2
+
+	TCCR1B = (1<<CS10);	// Count CPU cycles until millis takes TIMER1 over
+
+	// Relays off: battery path, same as after ext. power was lost
+	off(CHARGESEL);
+	off(SOURCESEL1);
+	off(SOURCESEL2);
+	off(FANCTRL);
+	out(CHARGESEL);
+	out(SOURCESEL1);
+	out(SOURCESEL2);
+	out(FANCTRL);
+
+	// Output follows the mech. switch right away
+	pullup(MECHSW);
+	_delay_us(10);	// Let the pullup settle
+	if (get(MECHSW)) off(OUTCTRL);
+	else on(OUTCTRL);
+	out(OUTCTRL);
+
+	bootTicks[BOOT_PROTECTED] = TCNT1;
+}
+
+void bootmark(uint8_t phase)
+{
+	// TIMER1 overflows after 65536 cycles (4ms), saturate
+	bootTicks[phase] = (TIFR1 & (1<<TOV1)) ? 0xFFFF : TCNT1;
+}
+
+void boot_delay()
+{
+	// TIMER1 stops meanwhile, boot phases only count the time spent working
+	TCCR1B = 0;
+	_delay_ms(BOOT_DELAY);
+	TCCR1B = (1<<CS10);
+}
+
+void boot_release()
+{
+	// Stop counting and hand TIMER1 over to millis_init()
+	TCCR1B = 0;
+	TCNT1 = 0;
+	TIFR1 = (1<<TOV1);
+}
+
+void boot_loop()
+{
+	bootLoopTime = millis();
+}
+
+void boot_report()
+{
+	// Telemetry line, sent once with the first PWR frame
+	printf_P(PSTR("BOOT t=%lu protected=%uus main=%uus configured=%uus loop=%lums\r\n"), millis(),
+		bootTicks[BOOT_PROTECTED] / (F_CPU / 1000000), bootTicks[BOOT_MAIN] / (F_CPU / 1000000), bootTicks[BOOT_CONFIGURED] / (F_CPU / 1000000), bootLoopTime);
+}
@@ -0,0 +1,35 @@
+/*
+ * Project: 12V DC Uninterruptable Power Supply
+ * File: boot.h
+ * Author: Thorin Hopkins (topy at untergrund dot net)
+ * Copyright: (C) 2014 by Thorin Hopkins
+ * License: GNU GPL v3 (see LICENSE.txt)
+ * Web: https://github.com/Topy44/ups
+ */ 
+
+
+#ifndef BOOT_H_
+#define BOOT_H_
+
+#include <stdint.h>
+
+// Relays and output are put into a safe state in .init1, right after reset. TIMER1 counts
+// CPU cycles from there on until it is handed over to millis, boot phases are timestamped
+// against it.
+
+// -- Boot phases
+#define BOOT_PROTECTED 0	// Relays off, output follows mech. switch
+#define BOOT_MAIN 1			// C runtime initialized, main() entered
+#define BOOT_CONFIGURED 2	// Pins, timers, ADC and INT0 configured
+#define BOOT_PHASES 3
+
+#define BOOT_DELAY 200		// ms at the start of main() to slow down reset loops
+
+// -- Prototypes
+void bootmark(uint8_t phase);
+void boot_delay();
+void boot_release();
+void boot_loop();
+void boot_report();
+
+#endif /* BOOT_H_ */
@@ -0,0 +1,143 @@
+/*
+ * Project: 12V DC Uninterruptable Power Supply
+ * File: charge.cpp
+ * Author: Thorin Hopkins (topy at untergrund dot net)
+ * Copyright: (C) 2014 by Thorin Hopkins
+ * License: GNU GPL v3 (see LICENSE.txt)
+ * Web: https://github.com/Topy44/ups
+ */ 
+
+#include <avr/io.h>
+
+#include "charge.h"
+#include "battery.h"
+#include "trace.h"
+
+#include <avr/pgmspace.h>
+#include <stdio.h>
+#include "millis.h"
+
+// Resting full minus hysteresis, chargers that stop a little early still count as done
+#define CHG_TARGET (BATMAX - BATHYST)
+
+static uint8_t chgState = CHG_OFF;
+static uint8_t chgRestarts;
+static millis_t chgTime;			// Window start or restart time
+static int16_t chgWindowMv[BAT_CHANNELS];		// Voltages at window start
+static int16_t chgRate[BAT_CHANNELS];			// mV/h over the last window
+static uint16_t chgEta = CHG_ETAUNKNOWN;
+
+static void chgwindow(millis_t now, const int16_t *mv)
+{
+	chgTime = now;
+	for (uint8_t i = 0; i < BAT_CHANNELS; i++) chgWindowMv[i] = mv[i];
+}
+
+static uint16_t chgeta(int16_t mv, int16_t rate)
+{
+	// Minutes to CHG_TARGET at the current rate
+	if (mv >= CHG_TARGET) return 0;
+	if (rate <= 0) return CHG_ETAUNKNOWN;
+	uint32_t eta = (uint32_t)(CHG_TARGET - mv) * 60 / rate;
+	return eta < CHG_ETAUNKNOWN ? eta : CHG_ETAUNKNOWN;
+}
+
+uint8_t charge_update(bool power, uint8_t stat, const int16_t *mv)
+{
+	millis_t now = millis();
+	if (!power)
+	{
+		chgState = CHG_OFF;
+		return CHG_NONE;
+	}
+
+	switch (chgState)
+	{
+		case CHG_OFF:
+			// Ext. power taken over, charger was just enabled
+			chgState = CHG_CHARGING;
+			chgRestarts = 0;
+			for (uint8_t i = 0; i < BAT_CHANNELS; i++) chgRate[i] = 0;
+			chgEta = CHG_ETAUNKNOWN;
+			chgwindow(now, mv);
+			break;
+
+		case CHG_CHARGING:
+		{
+			bool full = !stat;
+			for (uint8_t i = 0; i < BAT_CHANNELS; i++) if (mv[i] < CHG_TARGET) full = false;
+			if (full)
+			{
+				chgState = CHG_DONE;
+				chgEta = 0;
+				trace(TR_CHARGE, 3);
+				printf_P(PSTR("Charge complete\r\n"));
+				break;
+			}
+			if (now - chgTime < CHG_WINDOW) break;
+
+			// Window over, work out progress
+			bool stalled = false;
+			uint16_t eta = 0;
+			for (uint8_t i = 0; i < BAT_CHANNELS; i++)
+			{
+				int32_t rate = (int32_t)(mv[i] - chgWindowMv[i]) * (3600000UL / CHG_WINDOW);
+				chgRate[i] = rate > 32767 ? 32767 : (rate < -32767 ? -32767 : rate);
+				if (mv[i] < CHG_TARGET && (!(stat & 1 << i) || chgRate[i] < BATCHGRISE)) stalled = true;
+				uint16_t e = chgeta(mv[i], chgRate[i]);
+				if (e > eta) eta = e;
+			}
+			chgEta = eta;
+			chgwindow(now, mv);
+
+			if (stalled && chgRestarts < CHG_MAXRESTARTS)
+			{
+				chgState = CHG_RESTART;
+				chgRestarts++;
+				trace(TR_CHARGE, 2);
+				printf_P(PSTR("Charge stalled ("));
+				for (uint8_t i = 0; i < BAT_CHANNELS; i++) printf_P(i ? PSTR(", %d") : PSTR("%d"), chgRate[i]);
+				printf_P(PSTR(" mV/h), restarting charger\r\n"));
+				return CHG_CUT;
+			}
+			break;
+		}
+
+		case CHG_RESTART:
+			if (now - chgTime < CHG_OFFTIME) break;
+			chgState = CHG_CHARGING;
+			chgwindow(now, mv);
+			return CHG_RESUME;
+
+		case CHG_DONE:
+			// Charger topped up again on its own
+			if (stat)
+			{
+				chgState = CHG_CHARGING;
+				chgEta = CHG_ETAUNKNOWN;
+				chgwindow(now, mv);
+			}
+			break;
+	}
+	return CHG_NONE;
+}
+
+uint8_t charge_state()
+{
+	return chgState;
+}
+
+int16_t charge_rate(uint8_t bat)
+{
+	return chgRate[bat];
+}
+
+uint16_t charge_eta()
+{
+	return chgEta;
+}
+
+uint8_t charge_restarts()
+{
+	return chgRestarts;
+}
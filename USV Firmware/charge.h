@@ -0,0 +1,46 @@
+/*
+ * Project: 12V DC Uninterruptable Power Supply
+ * File: charge.h
+ * Author: Thorin Hopkins (topy at untergrund dot net)
+ * Copyright: (C) 2014 by Thorin Hopkins
+ * License: GNU GPL v3 (see LICENSE.txt)
+ * Web: https://github.com/Topy44/ups
+ */ 
+
+
+#ifndef CHARGE_H_
+#define CHARGE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Charge supervision. While on ext. power the voltage rise of each battery is checked every
+// CHG_WINDOW. The charger is only restarted (CHARGESEL off for CHG_OFFTIME, which resets its
+// safety timer) when a battery below full stopped charging or rises slower than the profile's
+// minimum. Nothing blocks, the main loop applies the returned action to CHARGESEL.
+
+// -- Constants
+#define CHG_WINDOW 900000UL		// Progress check interval (15 min)
+#define CHG_OFFTIME 4500		// CHARGESEL off time for a restart
+#define CHG_MAXRESTARTS 8		// Per ext. power period
+#define CHG_ETAUNKNOWN 0xFFFF
+
+// -- States
+#define CHG_OFF 0			// No ext. power
+#define CHG_CHARGING 1
+#define CHG_RESTART 2		// Charger cut off for a restart
+#define CHG_DONE 3
+
+// -- Actions
+#define CHG_NONE 0
+#define CHG_CUT 1			// Turn CHARGESEL off
+#define CHG_RESUME 2		// Turn CHARGESEL back on
+
+// -- Prototypes
+uint8_t charge_update(bool power, uint8_t stat, const int16_t *mv);	// stat: bat_chargemask()
+uint8_t charge_state();
+int16_t charge_rate(uint8_t bat);
+uint16_t charge_eta();
+uint8_t charge_restarts();
+
+#endif /* CHARGE_H_ */
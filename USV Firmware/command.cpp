@@ -0,0 +1,286 @@
+/*
+ * Project: 12V DC Uninterruptable Power Supply
+ * File: command.cpp
+ * Author: Thorin Hopkins (topy at untergrund dot net)
+ * Copyright: (C) 2014 by Thorin Hopkins
+ * License: GNU GPL v3 (see LICENSE.txt)
+ * Web: https://github.com/Topy44/ups
+ */ 
+
+#include <stdlib.h>
+#include <string.h>
+#include <avr/io.h>
+
+#include "global.h"
+#include "command.h"
+
+#include <avr/pgmspace.h>
+#include <stdbool.h>
+#include "serial.h"
+#include "millis.h"
+#include "trace.h"
+#include "tele.h"
+#include "history.h"
+#include "stats.h"
+#include "relay.h"
+#include "modbus.h"
+
+static char cmdBuf[CMDBUF_SIZE];
+static uint8_t cmdLen = 0;
+static bool cmdOverflow = false;	// Line didn't fit cmdBuf, isn't run
+
+static const char laneAlarm[] PROGMEM = "alarm";
+static const char laneStatus[] PROGMEM = "status";
+static const char laneBulk[] PROGMEM = "bulk";
+static PGM_P const laneNames[LANES] PROGMEM = { laneAlarm, laneStatus, laneBulk };
+
+static uint32_t baudPrevious = 0;	// Rate to go back to if the new one is not confirmed
+static millis_t baudTime = 0;
+
+// Compare first word of line with a command name, return pointer to the arguments or NULL
+static char *cmdmatch(char *line, PGM_P name)
+{
+	uint8_t len = strlen_P(name);
+	if (strncmp_P(line, name, len) != 0) return NULL;
+	if (line[len] == '\0') return line + len;
+	if (line[len] != ' ') return NULL;
+	return line + len + 1;
+}
+
+// Parse the next decimal argument and advance past it. False if there is none or it has
+// trailing junk.
+static bool cmdlong(char **args, uint32_t *value)
+{
+	char *p = *args;
+	while (*p == ' ') p++;
+	if (*p < '0' || *p > '9') return false;
+	char *end;
+	*value = strtoul(p, &end, 10);
+	if (*end != ' ' && *end != '\0') return false;
+	*args = end;
+	return true;
+}
+
+// Same for arguments that have to fit 16 bits
+static bool cmdnumber(char **args, uint16_t *value)
+{
+	char *p = *args;
+	uint32_t v;
+	if (!cmdlong(&p, &v) || v > 0xFFFF) return false;
+	*value = v;
+	*args = p;
+	return true;
+}
+
+// True if nothing but spaces is left
+static bool cmdend(const char *args)
+{
+	while (*args == ' ') args++;
+	return *args == '\0';
+}
+
+static bool cmdrun(char *line)
+{
+	char *args;
+
+	if ((args = cmdmatch(line, PSTR("ping"))))
+	{
+		printf_P(PSTR("pong\r\n"));
+	}
+	else if ((args = cmdmatch(line, PSTR("baud"))))
+	{
+		if (*args == '\0')
+		{
+			printf_P(PSTR("OK baud %lu\r\n"), serial_getbaud());
+			return true;
+		}
+
+		uint32_t baud;
+		if (!cmdlong(&args, &baud) || !cmdend(args) || !serial_baudok(baud))
+		{
+			printf_P(PSTR("ERR baud rate not possible\r\n"));
+			return false;
+		}
+		uint32_t previous = serial_getbaud();
+		printf_P(PSTR("OK baud %lu\r\n"), baud);	// Acknowledge at the old rate
+		serial_setbaud(baud);
+		baudPrevious = previous;
+		baudTime = millis();
+	}
+	else if ((args = cmdmatch(line, PSTR("trace"))))
+	{
+		trace_dump();
+	}
+	else if ((args = cmdmatch(line, PSTR("sub"))))
+	{
+		if (*args == '\0')
+		{
+			tele_list();
+			return true;
+		}
+
+		char *value = strchr(args, ' ');
+		if (value) *value++ = '\0';
+		int8_t group = tele_find(args);
+		if (group < 0 || !value)
+		{
+			printf_P(PSTR("ERR sub <group> on|off|<deadband> <min> <max>\r\n"));
+			return false;
+		}
+
+		if (strcmp_P(value, PSTR("on")) == 0 || strcmp_P(value, PSTR("off")) == 0)
+		{
+			tele_enable(group, value[1] == 'n');
+		}
+		else
+		{
+			uint16_t deadband, minInterval, maxInterval;
+			if (!cmdnumber(&value, &deadband) || !cmdnumber(&value, &minInterval) || !cmdnumber(&value, &maxInterval) || !cmdend(value))
+			{
+				printf_P(PSTR("ERR sub <group> on|off|<deadband> <min> <max>\r\n"));
+				return false;
+			}
+			if (maxInterval == 0 || maxInterval < minInterval)
+			{
+				printf_P(PSTR("ERR need 0 < max, min <= max\r\n"));
+				return false;
+			}
+			tele_config(group, true, deadband, minInterval, maxInterval);
+		}
+		printf_P(PSTR("OK\r\n"));
+	}
+	else if ((args = cmdmatch(line, PSTR("hist"))))
+	{
+		uint8_t tier = HIST_TIERS;
+		if (strcmp_P(args, PSTR("sec")) == 0) tier = HIST_SEC;
+		else if (strcmp_P(args, PSTR("min")) == 0) tier = HIST_MIN;
+		else if (strcmp_P(args, PSTR("day")) == 0) tier = HIST_DAY;
+		if (!history_dump(tier))
+		{
+			printf_P(PSTR("ERR hist sec|min|day\r\n"));
+			return false;
+		}
+	}
+	else if ((args = cmdmatch(line, PSTR("stats"))))
+	{
+		if (*args == '\0')
+		{
+			printf_P(PSTR("OK window %u\r\n"), stats_window());
+			stats_report();
+			return true;
+		}
+
+		uint16_t window;
+		if (!cmdnumber(&args, &window) || !cmdend(args) || window < STATS_MINWINDOW)
+		{
+			printf_P(PSTR("ERR window >= 1000ms\r\n"));
+			return false;
+		}
+		stats_setwindow(window);
+		printf_P(PSTR("OK\r\n"));
+	}
+	else if ((args = cmdmatch(line, PSTR("heartbeat"))))
+	{
+		uint16_t interval;
+		if (!cmdnumber(&args, &interval) || !cmdend(args) || interval < 100)
+		{
+			printf_P(PSTR("ERR heartbeat >= 100ms\r\n"));
+			return false;
+		}
+		tele_setheartbeat(interval);
+		printf_P(PSTR("OK\r\n"));
+	}
+	else if ((args = cmdmatch(line, PSTR("lane"))))
+	{
+		if (*args == '\0')
+		{
+			for (uint8_t i = 0; i < LANES; i++)
+			{
+				lanestats st;
+				s_getlane(i, &st);
+				printf_P(PSTR("LANE %S %S size=%u peak=%u frames=%u drops=%u stalls=%u\r\n"), (PGM_P)pgm_read_word(&laneNames[i]),
+					st.policy == LANE_DROP ? PSTR("drop") : PSTR("block"), st.size, st.peak, st.frames, st.drops, st.stalls);
+			}
+			return true;
+		}
+
+		uint8_t lane = LANES;
+		for (uint8_t i = 0; i < LANES; i++)
+		{
+			PGM_P name = (PGM_P)pgm_read_word(&laneNames[i]);
+			uint8_t len = strlen_P(name);
+			if (strncmp_P(args, name, len) == 0 && args[len] == ' ') lane = i;
+		}
+		char *policy = strchr(args, ' ');
+		if (lane == LANES || !policy || (strcmp_P(policy + 1, PSTR("block")) && strcmp_P(policy + 1, PSTR("drop"))))
+		{
+			printf_P(PSTR("ERR lane alarm|status|bulk block|drop\r\n"));
+			return false;
+		}
+		s_setpolicy(lane, strcmp_P(policy + 1, PSTR("drop")) == 0 ? LANE_DROP : LANE_BLOCK);
+		printf_P(PSTR("OK\r\n"));
+	}
+	else if ((args = cmdmatch(line, PSTR("relay"))))
+	{
+		relay_report();
+	}
+	else if ((args = cmdmatch(line, PSTR("modbus"))))
+	{
+		printf_P(PSTR("OK modbus\r\n"));
+		while (!s_txempty());	// Text goes quiet from here on
+		mb_start(millis());
+	}
+	else
+	{
+		printf_P(PSTR("ERR unknown command\r\n"));
+		return false;
+	}
+
+	return true;
+}
+
+void cmdcheck()
+{
+	if (baudPrevious && millis() - baudTime >= BAUDCONFIRM)
+	{
+		// Nobody talked to us at the new rate, go back
+		serial_setbaud(baudPrevious);
+		baudPrevious = 0;
+		printf_P(PSTR("Baud rate not confirmed, back to %lu\r\n"), serial_getbaud());
+	}
+
+	mb_check(millis());
+	while (s_hasdata())
+	{
+		char c = s_getchr(stdin);
+		if ((cmdLen == 0 || mb_active()) && mb_receive(c, millis()))
+		{
+			cmdLen = 0;		// Modbus frame, see modbus.h
+			cmdOverflow = false;
+			continue;
+		}
+		if (c == '\r' || c == '\n')
+		{
+			if (cmdLen == 0) continue;
+			cmdBuf[cmdLen] = '\0';
+			cmdLen = 0;
+			if (cmdOverflow)
+			{
+				// Cut off arguments would run with the wrong values
+				cmdOverflow = false;
+				printf_P(PSTR("ERR line too long\r\n"));
+				continue;
+			}
+
+			// Only a valid command confirms a new baud rate
+			uint32_t pending = baudPrevious;
+			baudPrevious = 0;
+			if (!cmdrun(cmdBuf) && !baudPrevious) baudPrevious = pending;
+		}
+		else if (cmdLen < CMDBUF_SIZE - 1)
+		{
+			cmdBuf[cmdLen++] = c;
+		}
+		else cmdOverflow = true;
+	}
+}
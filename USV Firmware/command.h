@@ -0,0 +1,38 @@
+/*
+ * Project: 12V DC Uninterruptable Power Supply
+ * File: command.h
+ * Author: Thorin Hopkins (topy at untergrund dot net)
+ * Copyright: (C) 2014 by Thorin Hopkins
+ * License: GNU GPL v3 (see LICENSE.txt)
+ * Web: https://github.com/Topy44/ups
+ */ 
+
+
+#ifndef COMMAND_H_
+#define COMMAND_H_
+
+// Line based commands on the serial port, terminated by CR or LF:
+//   ping			Answers "pong"
+//   baud			Show current baud rate
+//   baud <rate>	Switch baud rate. The host has to send a valid command at the new
+//					rate within BAUDCONFIRM, otherwise the old rate is restored.
+//   trace			Dump the event trace buffer
+//   sub			List telemetry subscriptions
+//   sub <group> on|off
+//   sub <group> <deadband> <min ms> <max ms>
+//   heartbeat <ms>	Interval of the full status report
+//   hist sec|min|day	Stream the voltage history of a tier
+//   stats [ms]		Show the last statistics window, or set the window length
+//   lane			Output lane policies and counters
+//   lane <name> block|drop
+//   relay			Relay settle time statistics (us) per relay and direction
+//   modbus			Switch to Modbus RTU until polling stops (see modbus.h)
+
+// -- Constants
+#define CMDBUF_SIZE 24
+#define BAUDCONFIRM 2000
+
+// -- Prototypes
+void cmdcheck();
+
+#endif /* COMMAND_H_ */
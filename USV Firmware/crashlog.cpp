@@ -0,0 +1,122 @@
+/*
+ * Project: 12V DC Uninterruptable Power Supply
+ * File: crashlog.cpp
+ * Author: Thorin Hopkins (topy at untergrund dot net)
+ * Copyright: (C) 2014 by Thorin Hopkins
+ * License: GNU GPL v3 (see LICENSE.txt)
+ * Web: https://github.com/Topy44/ups
+ */ 
+
+#include <avr/io.h>
+
+#include "global.h"
+#include "usvfirmware.h"
+#include "crashlog.h"
+
+#include <avr/interrupt.h>
+#include <avr/wdt.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+volatile uint8_t crashTask = TASK_INIT;
+
+// Not cleared at reset, validated by magic
+static crashrecord crashRecord __attribute__((section(".noinit")));
+static resetcounters resetCounters __attribute__((section(".noinit")));
+static uint8_t mcusrMirror __attribute__((section(".noinit")));
+
+static bool crashValid = false;
+
+extern "C" void crashlog_capture(uint16_t sp) __attribute__((noreturn, used));
+
+// Save and clear reset flags before anything else runs, a set WDRF would keep the watchdog enabled
+void crashlog_boot() __attribute__((naked, used, section(".init3")));
+void crashlog_boot()
+{
+	mcusrMirror = MCUSR;
+	MCUSR = 0;
+	wdt_disable();
+}
+
+void crashlog_init()
+{
+	// Counters only survive warm resets
+	if (resetCounters.magic != CRASHMAGIC || (mcusrMirror & (1<<PORF)))
+	{
+		resetCounters.magic = CRASHMAGIC;
+		resetCounters.watchdog = 0;
+		resetCounters.stall = 0;
+		resetCounters.brownout = 0;
+		resetCounters.external = 0;
+	}
+
+	crashValid = (mcusrMirror & (1<<WDRF)) && crashRecord.magic == CRASHMAGIC;
+	crashRecord.magic = 0;
+
+	if (mcusrMirror & (1<<WDRF)) resetCounters.watchdog++;
+	if (crashValid) resetCounters.stall++;
+	if (mcusrMirror & (1<<BORF)) resetCounters.brownout++;
+	if (mcusrMirror & (1<<EXTRF)) resetCounters.external++;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		wdt_reset();
+		WDTCSR = (1<<WDCE) | (1<<WDE);
+		WDTCSR = (1<<WDIE) | (1<<WDE) | (1<<WDP3) | (1<<WDP0);	// Interrupt, then reset, 8 seconds
+	}
+}
+
+void crashlog_report()
+{
+	printf_P(PSTR("Reset cause:%S%S%S%S\r\n"),
+		(mcusrMirror & (1<<PORF)) ? PSTR(" power-on") : PSTR(""),
+		(mcusrMirror & (1<<EXTRF)) ? PSTR(" external") : PSTR(""),
+		(mcusrMirror & (1<<BORF)) ? PSTR(" brown-out") : PSTR(""),
+		(mcusrMirror & (1<<WDRF)) ? PSTR(" watchdog") : PSTR(""));
+	printf_P(PSTR("Resets since power-on: watchdog %u (stalls %u), brown-out %u, external %u\r\n"), resetCounters.watchdog, resetCounters.stall, resetCounters.brownout, resetCounters.external);
+
+	if (crashValid)
+	{
+		printf_P(PSTR("Watchdog stall in task %u at PC 0x%04x, SP 0x%04x, %lums after start, flags 0x%02x\r\n"), crashRecord.task, crashRecord.pc, crashRecord.sp, crashRecord.time, crashRecord.flags);
+	}
+}
+
+uint8_t crashlog_mcusr()
+{
+	return mcusrMirror;
+}
+
+const resetcounters *crashlog_counters()
+{
+	return &resetCounters;
+}
+
+// Stalls inside other ISRs or atomic blocks can not be recorded, the watchdog just resets then
+ISR(WDT_vect, ISR_NAKED)
+{
+	// Return address of the stalled code is on top of the stack, pass SP on
+	asm volatile (
+		"	clr r1\n"
+		"	in r24, __SP_L__\n"
+		"	in r25, __SP_H__\n"
+		"	jmp crashlog_capture\n"
+	);
+}
+
+void crashlog_capture(uint16_t sp)
+{
+	const uint8_t *stack = (const uint8_t *)sp;
+
+	crashRecord.task = crashTask;
+	crashRecord.flags = stateflags();
+	crashRecord.pc = ((stack[1] << 8) | stack[2]) << 1;	// Pushed as word address, high byte on top
+	crashRecord.sp = sp + 2;	// SP before the interrupt
+	crashRecord.time = millis();
+	crashRecord.magic = CRASHMAGIC;
+
+	// Record is complete, reset right away instead of waiting for the next timeout
+	wdt_enable(WDTO_15MS);
+	for (;;);
+}
@@ -0,0 +1,57 @@
+/*
+ * Project: 12V DC Uninterruptable Power Supply
+ * File: crashlog.h
+ * Author: Thorin Hopkins (topy at untergrund dot net)
+ * Copyright: (C) 2014 by Thorin Hopkins
+ * License: GNU GPL v3 (see LICENSE.txt)
+ * Web: https://github.com/Topy44/ups
+ */ 
+
+
+#ifndef CRASHLOG_H_
+#define CRASHLOG_H_
+
+#include <stdint.h>
+#include <avr/io.h>
+#include "millis.h"
+
+// Watchdog runs in interrupt-then-reset mode. The interrupt stores a crash record in .noinit,
+// which survives the following reset and gets reported at boot.
+
+#define CRASHMAGIC 0xC0DE
+
+struct crashrecord
+{
+	uint16_t magic;
+	uint8_t task;		// Last task ID set with TASK()
+	uint8_t flags;		// State flags, see stateflags()
+	uint16_t pc;		// Byte address the stalled code was executing
+	uint16_t sp;
+	millis_t time;
+};
+
+struct resetcounters
+{
+	uint16_t magic;
+	uint16_t watchdog;
+	uint16_t stall;		// Watchdog resets with a crash record
+	uint16_t brownout;
+	uint16_t external;
+};
+
+extern volatile uint8_t crashTask;
+
+// Mark the task the main loop is currently working on
+#ifdef BENCH
+	#define TASK(x) (crashTask = GPIOR0 = (x))	// Also visible to the simulator, see tools/bench.sh
+#else
+	#define TASK(x) (crashTask = (x))
+#endif
+
+// -- Prototypes
+void crashlog_init();
+void crashlog_report();
+uint8_t crashlog_mcusr();
+const resetcounters *crashlog_counters();
+
+#endif /* CRASHLOG_H_ */
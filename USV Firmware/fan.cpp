@@ -0,0 +1,76 @@
+/*
+ * Project: 12V DC Uninterruptable Power Supply
+ * File: fan.cpp
+ * Author: Thorin Hopkins (topy at untergrund dot net)
+ * Copyright: (C) 2014 by Thorin Hopkins
+ * License: GNU GPL v3 (see LICENSE.txt)
+ * Web: https://github.com/Topy44/ups
+ */ 
+
+#include <avr/io.h>
+
+#include "global.h"
+#include "fan.h"
+
+#include <stdbool.h>
+#include "millis.h"
+#include "trace.h"
+
+static uint8_t fanDuty = 0;		// Duty currently on OC0B
+static uint8_t fanTarget = 0;	// Duty requested by fan_set()
+static bool fanKick = false;
+static millis_t fanStepTime = 0;
+
+void fan_init()
+{
+	OCR0B = 0;
+	TCCR0A = (1<<COM0B1) | (1<<WGM00);	// Non-inverting phase correct PWM on OC0B, TOP = 0xFF
+	TCCR0B = (1<<CS00);	// No prescaler
+}
+
+void fan_set(uint8_t duty)
+{
+	// Never run below the stall limit, either off or spinning
+	if (duty > 0 && duty < FANDUTYMIN) duty = FANDUTYMIN;
+	if (duty != fanTarget) trace(TR_FANDUTY, duty);
+	fanTarget = duty;
+
+	if (duty == 0)
+	{
+		// Stop right away, no need to ramp down
+		fanDuty = 0;
+		fanKick = false;
+		OCR0B = 0;
+	}
+	else if (fanDuty == 0)
+	{
+		// Soft start: hold start duty until the fan turns, then ramp to target
+		fanDuty = FANSTARTDUTY;
+		fanKick = true;
+		fanStepTime = millis();
+		OCR0B = fanDuty;
+	}
+}
+
+void fan_update()
+{
+	if (fanDuty == fanTarget) return;
+
+	millis_t now = millis();
+	if (fanKick)
+	{
+		if (now - fanStepTime < FANKICKTIME) return;
+		fanKick = false;
+	}
+	if (now - fanStepTime < FANRAMPSTEP) return;
+	fanStepTime = now;
+
+	if (fanDuty < fanTarget) fanDuty++;
+	else fanDuty--;
+	OCR0B = fanDuty;
+}
+
+uint8_t fan_duty()
+{
+	return fanDuty;
+}
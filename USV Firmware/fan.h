@@ -0,0 +1,31 @@
+/*
+ * Project: 12V DC Uninterruptable Power Supply
+ * File: fan.h
+ * Author: Thorin Hopkins (topy at untergrund dot net)
+ * Copyright: (C) 2014 by Thorin Hopkins
+ * License: GNU GPL v3 (see LICENSE.txt)
+ * Web: https://github.com/Topy44/ups
+ */ 
+
+
+#ifndef FAN_H_
+#define FAN_H_
+
+#include <stdint.h>
+
+// Fan is driven by TIMER0 phase correct PWM on OC0B (FANCTRL), F_CPU/510 = ~31kHz
+
+// -- Constants
+#define FANDUTYMAX 255
+#define FANDUTYMIN 77		// Lowest duty a spinning fan reliably keeps turning at (~30%)
+#define FANSTARTDUTY 128	// Duty used to get the fan turning from standstill
+#define FANKICKTIME 300		// Hold start duty for X ms before ramping
+#define FANRAMPSTEP 4		// Change duty by one step every X ms (~1s from off to full)
+
+// -- Prototypes
+void fan_init();
+void fan_set(uint8_t duty);
+void fan_update();
+uint8_t fan_duty();
+
+#endif /* FAN_H_ */
@@ -0,0 +1,44 @@
+/*
+ * Project: 12V DC Uninterruptable Power Supply
+ * File: fmt.cpp
+ * Author: Thorin Hopkins (topy at untergrund dot net)
+ * Copyright: (C) 2014 by Thorin Hopkins
+ * License: GNU GPL v3 (see LICENSE.txt)
+ * Web: https://github.com/Topy44/ups
+ */ 
+
+#include <avr/io.h>
+
+#include "fmt.h"
+
+#include <stdbool.h>
+
+char *fmt_fixed(char *buf, int32_t value, uint8_t decimals)
+{
+	// Format value as fixed point number, e.g. (7012, 3) -> "7.012", (-5, 2) -> "-0.05"
+	char tmp[FMTBUF_SIZE];
+	uint8_t i = 0;
+	uint8_t digits = decimals ? decimals + 2 : 1;	// Always print at least "0.xx"
+	bool neg = value < 0;
+	uint32_t v = neg ? -(uint32_t)value : value;
+
+	do
+	{
+		tmp[i++] = '0' + v % 10;
+		v /= 10;
+		if (decimals && i == decimals) tmp[i++] = '.';
+	} while (v || i < digits);
+
+	char *p = buf;
+	if (neg) *p++ = '-';
+	while (i) *p++ = tmp[--i];
+	*p = '\0';
+
+	return buf;
+}
+
+char *fmt_mv(char *buf, int16_t mv)
+{
+	// Format millivolts as volts with two decimals, rounded, e.g. 7016 -> "7.02"
+	return fmt_fixed(buf, (mv + (mv < 0 ? -5 : 5)) / 10, 2);
+}
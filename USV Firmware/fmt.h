@@ -0,0 +1,24 @@
+/*
+ * Project: 12V DC Uninterruptable Power Supply
+ * File: fmt.h
+ * Author: Thorin Hopkins (topy at untergrund dot net)
+ * Copyright: (C) 2014 by Thorin Hopkins
+ * License: GNU GPL v3 (see LICENSE.txt)
+ * Web: https://github.com/Topy44/ups
+ */ 
+
+
+#ifndef FMT_H_
+#define FMT_H_
+
+#include <stdint.h>
+
+// Lean number formatting so printf does not need the float version of vfprintf
+
+#define FMTBUF_SIZE 13	// Sign, 10 digits, decimal point, terminator
+
+// -- Prototypes
+char *fmt_fixed(char *buf, int32_t value, uint8_t decimals);
+char *fmt_mv(char *buf, int16_t mv);
+
+#endif /* FMT_H_ */
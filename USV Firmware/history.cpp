@@ -0,0 +1,252 @@
+/*
+ * Project: 12V DC Uninterruptable Power Supply
+ * File: history.cpp
+ * Author: Thorin Hopkins (topy at untergrund dot net)
+ * Copyright: (C) 2014 by Thorin Hopkins
+ * License: GNU GPL v3 (see LICENSE.txt)
+ * Web: https://github.com/Topy44/ups
+ */ 
+
+#include <stdlib.h>
+#include <avr/io.h>
+
+#include "history.h"
+#include "battery.h"
+
+#include <avr/pgmspace.h>
+#include <stdio.h>
+#include <string.h>
+#include "millis.h"
+#include "serial.h"
+
+// Longest delta record, varints take up to 3 bytes. Blocks are closed when the next record doesn't fit.
+constexpr uint8_t HIST_MAXRECORD = 2 + 3 * BAT_CHANNELS;
+static_assert(HIST_MAXRECORD < HIST_BLOCKSIZE, "History blocks too small for this many channels");
+
+struct histblock
+{
+	uint16_t start;		// Tier sample index of the first (absolute) sample
+	uint16_t v[BAT_CHANNELS];
+	uint8_t flags;
+	uint8_t len;
+	uint8_t data[HIST_BLOCKSIZE];
+};
+
+struct histtier
+{
+	uint8_t first;		// Offset in histBlocks
+	uint8_t size;
+	uint8_t head;		// Oldest block
+	uint8_t count;
+	uint8_t evicted;	// Blocks dropped, lets the stream skip past them
+	bool run;			// Last record is a repeat count that can be extended
+	uint16_t samples;
+	uint16_t v[BAT_CHANNELS];
+	uint8_t flags;
+};
+
+static histblock histBlocks[HIST_SECBLOCKS + HIST_MINBLOCKS + HIST_DAYBLOCKS];
+static histtier histTiers[HIST_TIERS] =
+{
+	{ 0, HIST_SECBLOCKS },
+	{ HIST_SECBLOCKS, HIST_MINBLOCKS },
+	{ HIST_SECBLOCKS + HIST_MINBLOCKS, HIST_DAYBLOCKS }
+};
+
+// Decimation into the minute and day tiers, indexed by tier - 1
+static uint32_t histSum[HIST_TIERS - 1][BAT_CHANNELS];
+static uint8_t histFlags[HIST_TIERS - 1];
+static uint8_t histCount[HIST_TIERS - 1];
+static millis_t histTimer;
+
+// Readout
+static int8_t streamTier = -1;
+static bool streamHeader;
+static uint8_t streamSent;
+static uint8_t streamEvicted;
+
+static uint8_t *histvarint(uint8_t *p, int16_t value)
+{
+	uint16_t v = (uint16_t)(value << 1) ^ (uint16_t)(value >> 15);	// Zigzag
+	while (v >= 0x80)
+	{
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+void history_append(uint8_t tier, const uint16_t *v, uint8_t flags)
+{
+	histtier *t = &histTiers[tier];
+	histblock *b = NULL;
+	if (t->count) b = &histBlocks[t->first + (t->head + t->count - 1) % t->size];
+
+	if (b)
+	{
+		// Delta record against the last sample, goes into the block if there is still room for it
+		int16_t d[BAT_CHANNELS];
+		bool same = true, small = true;
+		for (uint8_t i = 0; i < BAT_CHANNELS; i++)
+		{
+			d[i] = v[i] - t->v[i];
+			if (d[i] != 0) same = false;
+			if (d[i] < -4 || d[i] > 3) small = false;
+		}
+		uint8_t rec[HIST_MAXRECORD];
+		uint8_t *p = rec;
+		bool run = false;
+		if (same && flags == t->flags)
+		{
+			if (t->run && b->data[b->len - 1] < 0x7F) b->data[b->len - 1]++;
+			else *p++ = 1;
+			run = true;
+		}
+		else if (small && flags == t->flags)
+		{
+			// Tag bits "10", then 3 bits per channel
+			uint16_t acc = 0x02;
+			uint8_t bits = 2;
+			for (uint8_t i = 0; i < BAT_CHANNELS; i++)
+			{
+				acc = acc << 3 | (d[i] + 4);
+				bits += 3;
+				if (bits >= 8)
+				{
+					bits -= 8;
+					*p++ = acc >> bits;
+					acc &= (1 << bits) - 1;
+				}
+			}
+			if (bits) *p++ = acc << (8 - bits);
+		}
+		else
+		{
+			bool changed = flags != t->flags;
+			*p++ = 0xC0 | (changed ? 0x02 : 0);
+			for (uint8_t i = 0; i < BAT_CHANNELS; i++) p = histvarint(p, d[i]);
+			if (changed) *p++ = flags;
+		}
+
+		uint8_t len = p - rec;
+		if (b->len + len <= HIST_BLOCKSIZE)
+		{
+			memcpy(&b->data[b->len], rec, len);
+			b->len += len;
+			t->run = run;
+		}
+		else b = NULL;
+	}
+
+	if (!b)
+	{
+		// Start a new block with absolute values, drop the oldest if needed
+		if (t->count == t->size)
+		{
+			t->head = (t->head + 1) % t->size;
+			t->count--;
+			t->evicted++;
+		}
+		b = &histBlocks[t->first + (t->head + t->count) % t->size];
+		t->count++;
+		b->start = t->samples;
+		for (uint8_t i = 0; i < BAT_CHANNELS; i++) b->v[i] = v[i];
+		b->flags = flags;
+		b->len = 0;
+		t->run = false;
+	}
+
+	t->samples++;
+	for (uint8_t i = 0; i < BAT_CHANNELS; i++) t->v[i] = v[i];
+	t->flags = flags;
+}
+
+static uint8_t histdecimate(uint8_t tier)
+{
+	// Samples of the tier below per sample
+	return tier == HIST_MIN ? HIST_DECIMATE : HIST_DAYDECIMATE;
+}
+
+static void histaverage(uint8_t tier, const uint16_t *v, uint8_t flags)
+{
+	// Average samples of the tier below into this one, full averages go on up
+	uint32_t *sum = histSum[tier - 1];
+	for (uint8_t i = 0; i < BAT_CHANNELS; i++) sum[i] += v[i];
+	histFlags[tier - 1] |= flags;
+	uint8_t n = histdecimate(tier);
+	if (++histCount[tier - 1] < n) return;
+
+	histtier *t = &histTiers[tier];
+	uint16_t avg[BAT_CHANNELS];
+	for (uint8_t i = 0; i < BAT_CHANNELS; i++)
+	{
+		avg[i] = (sum[i] + n/2) / n;
+		sum[i] = 0;
+		// Averages flickering between two steps would cost a record every sample
+		if (t->samples && abs((int16_t)(avg[i] - t->v[i])) <= HIST_BAND) avg[i] = t->v[i];
+	}
+	flags = histFlags[tier - 1];
+	histFlags[tier - 1] = 0;
+	histCount[tier - 1] = 0;
+	history_append(tier, avg, flags);
+	if (tier + 1 < HIST_TIERS) histaverage(tier + 1, avg, flags);
+}
+
+void history_update(const int16_t *mv, uint8_t flags)
+{
+	// Called every main loop pass, catches up on seconds missed during blocking delays
+	while (millis() - histTimer >= 1000)
+	{
+		histTimer += 1000;
+		uint16_t v[BAT_CHANNELS];
+		for (uint8_t i = 0; i < BAT_CHANNELS; i++) v[i] = mv[i] > 0 ? (mv[i] + HIST_UNIT/2) / HIST_UNIT : 0;
+		history_append(HIST_SEC, v, flags);
+		histaverage(HIST_MIN, v, flags);
+	}
+}
+
+bool history_dump(uint8_t tier)
+{
+	// Start streaming a tier, blocks go out from history_stream()
+	if (tier >= HIST_TIERS) return false;
+	histtier *t = &histTiers[tier];
+	streamTier = tier;
+	streamHeader = true;
+	streamSent = 0;
+	streamEvicted = t->evicted;
+	return true;
+}
+
+void history_stream()
+{
+	// One line per call on the bulk lane, once the previous one has left
+	if (streamTier < 0 || !s_laneempty(LANE_BULK)) return;
+
+	histtier *t = &histTiers[streamTier];
+	if (streamHeader)
+	{
+		uint16_t interval = 1;
+		for (uint8_t i = HIST_MIN; i <= streamTier; i++) interval *= histdecimate(i);
+		fprintf_P(&s_bulk, PSTR("HIST %u %u %u %u %lu %u\r\n"), streamTier, interval, HIST_UNIT, t->samples, millis(), BAT_CHANNELS);
+		streamHeader = false;
+		return;
+	}
+	uint8_t dropped = t->evicted - streamEvicted;	// Blocks that went away since the dump started
+	uint8_t idx = streamSent > dropped ? streamSent - dropped : 0;
+	if (idx >= t->count)
+	{
+		fprintf_P(&s_bulk, PSTR("HIST END\r\n"));
+		streamTier = -1;
+		return;
+	}
+
+	// Newest block is sent as it is now, samples added after the header just get later timestamps
+	histblock *b = &histBlocks[t->first + (t->head + idx) % t->size];
+	fprintf_P(&s_bulk, PSTR("HB %u "), b->start);
+	for (uint8_t i = 0; i < BAT_CHANNELS; i++) fprintf_P(&s_bulk, PSTR("%u "), b->v[i]);
+	fprintf_P(&s_bulk, PSTR("%02X "), b->flags);
+	for (uint8_t i = 0; i < b->len; i++) fprintf_P(&s_bulk, PSTR("%02X"), b->data[i]);
+	fprintf_P(&s_bulk, PSTR("\r\n"));
+	streamSent = idx + dropped + 1;
+}
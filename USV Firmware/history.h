@@ -0,0 +1,54 @@
+/*
+ * Project: 12V DC Uninterruptable Power Supply
+ * File: history.h
+ * Author: Thorin Hopkins (topy at untergrund dot net)
+ * Copyright: (C) 2014 by Thorin Hopkins
+ * License: GNU GPL v3 (see LICENSE.txt)
+ * Web: https://github.com/Topy44/ups
+ */ 
+
+
+#ifndef HISTORY_H_
+#define HISTORY_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Compressed battery voltage history in SRAM. Three tiers: one sample per second for the last
+// minutes, one per minute for the last hours and one per 10 minutes for the last day (averages,
+// state flags or'ed). Averages are only recorded once they moved by more than HIST_BAND steps.
+// A changing sample usually costs a byte. The day tier holds more than 24 hours of a day with an
+// outage (hours of discharge and recharge, float otherwise), about 8 hours if the voltages never
+// settle. On float charge the minute and day tiers reach much further back.
+// Each tier is a ring of fixed size blocks. A block starts with absolute values for every
+// battery channel, followed by delta records:
+//   0nnnnnnn					n unchanged samples (1-127)
+//   10aaabbb [ccc...]			All deltas (10mV) in -4..3, flags unchanged. 3 bits (delta + 4)
+//								per channel, MSB first, the first two in the tag byte
+//   110000f0 <d1>..<dn> [flags]	Zigzag varint deltas, flags follow if f is set
+// Appending is O(1), the oldest block is dropped when a tier is full. The "hist" command
+// streams a tier one block per main loop pass, decode with tools/hist2csv.py.
+
+// -- Constants
+#define HIST_UNIT 10			// mV per step
+#define HIST_BLOCKSIZE 32		// Data bytes per block
+#define HIST_SECBLOCKS 2
+#define HIST_MINBLOCKS 3		// 32 bytes hold about 25 changing samples
+#define HIST_DAYBLOCKS 5		// 144 samples a day
+#define HIST_DECIMATE 60		// Second samples per minute sample
+#define HIST_DAYDECIMATE 10		// Minute samples per day tier sample
+#define HIST_BAND 1				// Steps an average has to move before it is recorded
+
+// -- Tiers
+#define HIST_SEC 0
+#define HIST_MIN 1
+#define HIST_DAY 2
+#define HIST_TIERS 3
+
+// -- Prototypes
+void history_update(const int16_t *mv, uint8_t flags);
+void history_append(uint8_t tier, const uint16_t *v, uint8_t flags);
+bool history_dump(uint8_t tier);
+void history_stream();
+
+#endif /* HISTORY_H_ */
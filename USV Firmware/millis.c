@@ -58,8 +58,12 @@
 // Timer1
 
 // 1KHz - 65.28MHz
-#define CLOCKSEL (_BV(CS10))
-#define PRESCALER 1
+#if MILLIS_TIMER1_PRESCALER == 1
+	#define CLOCKSEL (_BV(CS10))
+#else
+	#error "Timer1 prescaler not supported"
+#endif
+#define PRESCALER MILLIS_TIMER1_PRESCALER
 
 #define REG_TCCRA		TCCR1A
 #define REG_TCCRB		TCCR1B
@@ -109,7 +113,7 @@
 	#error "Bad MILLIS_TIMER set"
 #endif
 
-static volatile millis_t milliseconds;
+volatile millis_t milliseconds;
 
 // Initialise library
 void millis_init()
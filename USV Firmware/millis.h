@@ -23,7 +23,8 @@ typedef unsigned long millis_t;
 #define MILLIS_TIMER1 1 /**< Use timer1. */
 #define MILLIS_TIMER2 2 /**< Use timer2. */
 
-#define MILLIS_TIMER MILLIS_TIMER0 /**< Which timer to use. */
+#define MILLIS_TIMER MILLIS_TIMER1 /**< Which timer to use. */
+#define MILLIS_TIMER1_PRESCALER 1 /**< Timer1 prescaler, with 1 TCNT1 counts CPU cycles. */
 
 #ifndef ARDUINO
 /**
@@ -38,6 +39,11 @@ typedef unsigned long millis_t;
 extern "C" {
 #endif
 
+/**
+* Millisecond counter, only read directly with interrupts off (see trace.h).
+*/
+extern volatile millis_t milliseconds;
+
 /**
 * Initialise, must be called before anything else!
 *
@@ -0,0 +1,217 @@
+/*
+ * Project: 12V DC Uninterruptable Power Supply
+ * File: modbus.cpp
+ * Author: Thorin Hopkins (topy at untergrund dot net)
+ * Copyright: (C) 2014 by Thorin Hopkins
+ * License: GNU GPL v3 (see LICENSE.txt)
+ * Web: https://github.com/Topy44/ups
+ */ 
+
+#include "modbus.h"
+
+// No AVR headers in here, see modbus.h
+
+static uint8_t mbFrame[MB_FRAMESIZE];
+static uint16_t mbLen;				// Bytes of the current frame, may run past MB_FRAMESIZE
+static uint16_t mbNeed;				// Expected frame length, 0 while unknown
+static millis_t mbByteTime;			// Last byte of the current frame
+static bool mbActive;				// Text output muted
+static millis_t mbRequestTime;
+static uint8_t mbAddress = MB_ADDRESS;
+static uint16_t mbIdle = MB_IDLE;
+static uint16_t mbFrames;
+static uint16_t mbCrc = 0xFFFF;		// Of the response being sent
+
+static uint16_t mbcrc(uint16_t crc, const uint8_t *buf, uint8_t len)
+{
+	while (len--)
+	{
+		crc ^= *buf++;
+		for (uint8_t i = 0; i < 8; i++) crc = crc & 1 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+	}
+	return crc;
+}
+
+uint16_t mb_crc(const uint8_t *buf, uint8_t len)
+{
+	return mbcrc(0xFFFF, buf, len);
+}
+
+static void mbsend(const uint8_t *buf, uint8_t len)
+{
+	// Part of a response, the CRC runs on
+	mbCrc = mbcrc(mbCrc, buf, len);
+	mb_send(buf, len);
+}
+
+static void mbend()
+{
+	uint8_t crc[2] = { (uint8_t)mbCrc, (uint8_t)(mbCrc >> 8) };
+	mb_send(crc, 2);
+	mbCrc = 0xFFFF;
+	mbFrames++;
+}
+
+static void mbexception(uint8_t code)
+{
+	uint8_t r[3] = { mbFrame[0], (uint8_t)(mbFrame[1] | 0x80), code };
+	mbsend(r, 3);
+	mbend();
+}
+
+static bool mbaddressok(uint16_t address)
+{
+	// Has to start a frame while idle, see mb_receive()
+	return address >= 1 && address <= MB_MAXADDRESS && address != '\r' && address != '\n';
+}
+
+static uint8_t mbwrite(uint16_t reg, uint16_t value, bool apply)
+{
+	// Own configuration, the rest goes to the firmware
+	if (reg == MB_REG_ADDRESS)
+	{
+		if (!mbaddressok(value)) return MB_EXVALUE;
+		if (apply) mbAddress = value;
+		return 0;
+	}
+	if (reg == MB_REG_IDLE)
+	{
+		if (apply) mbIdle = value;
+		return 0;
+	}
+	return mb_write(reg, value, apply);
+}
+
+static void mbread(uint16_t start, uint16_t count)
+{
+	uint16_t regs[MB_REGS];
+	mb_snapshot(regs);
+	regs[MB_REG_FRAMES] = mbFrames;
+	regs[MB_REG_ADDRESS] = mbAddress;
+	regs[MB_REG_IDLE] = mbIdle;
+
+	// Big endian in place, then out it goes
+	for (uint16_t i = start; i < start + count; i++) regs[i] = regs[i] << 8 | regs[i] >> 8;
+	uint8_t r[3] = { mbFrame[0], mbFrame[1], (uint8_t)(count * 2) };
+	mbsend(r, 3);
+	uint8_t *p = (uint8_t *)&regs[start];
+	uint16_t left = count * 2;
+	while (left)
+	{
+		uint8_t n = left > 128 ? 128 : left;
+		mbsend(p, n);
+		p += n;
+		left -= n;
+	}
+	mbend();
+}
+
+static void mbrequest(uint16_t len)
+{
+	uint8_t fc = mbFrame[1];
+	bool broadcast = mbFrame[0] == 0;
+	uint16_t start = mbFrame[2] << 8 | mbFrame[3];
+	uint16_t count = mbFrame[4] << 8 | mbFrame[5];
+
+	if (fc == MB_READHOLDING || fc == MB_READINPUT)
+	{
+		if (broadcast) return;
+		if (count == 0 || count > MB_MAXREAD) mbexception(MB_EXVALUE);
+		else if (start >= MB_REGS || count > MB_REGS - start) mbexception(MB_EXADDRESS);
+		else mbread(start, count);
+	}
+	else if (fc == MB_WRITESINGLE)
+	{
+		// count is the value here
+		uint8_t ex = start < MB_REG_CONFIG || start >= MB_REGS ? MB_EXADDRESS : mbwrite(start, count, true);
+		if (broadcast) return;
+		if (ex) mbexception(ex);
+		else
+		{
+			mbsend(mbFrame, 6);		// Echo
+			mbend();
+		}
+	}
+	else if (fc == MB_WRITEMULTIPLE)
+	{
+		uint8_t ex = 0;
+		if (count == 0 || mbFrame[6] != count * 2 || len != 9U + count * 2) ex = MB_EXVALUE;
+		else if (start < MB_REG_CONFIG || start >= MB_REGS || count > MB_REGS - start) ex = MB_EXADDRESS;
+		else
+		{
+			// Check all, then apply all
+			for (uint16_t i = 0; i < count && !ex; i++) ex = mbwrite(start + i, mbFrame[7 + 2*i] << 8 | mbFrame[8 + 2*i], false);
+			for (uint16_t i = 0; i < count && !ex; i++) mbwrite(start + i, mbFrame[7 + 2*i] << 8 | mbFrame[8 + 2*i], true);
+		}
+		if (broadcast) return;
+		if (ex) mbexception(ex);
+		else
+		{
+			mbsend(mbFrame, 6);
+			mbend();
+		}
+	}
+	else if (!broadcast) mbexception(MB_EXFUNCTION);
+}
+
+static void mbframe(millis_t now)
+{
+	// A frame is complete: check it, answer if it's for us
+	uint16_t len = mbLen;
+	mbLen = mbNeed = 0;
+	if (len < 4 || len > MB_FRAMESIZE) return;
+	uint16_t crc = mb_crc(mbFrame, len - 2);
+	if (mbFrame[len - 2] != (uint8_t)crc || mbFrame[len - 1] != crc >> 8) return;	// Noise, no answer
+	if (mbFrame[0] != mbAddress && mbFrame[0] != 0) return;		// Someone else on the bus
+
+	mb_start(now);
+	mbrequest(len);
+}
+
+bool mb_receive(uint8_t c, millis_t now)
+{
+	// Returns false if c is text
+	if (mbLen == 0 && !mbActive && (c >= 0x20 || c == '\r' || c == '\n')) return false;
+
+	mbByteTime = now;
+	if (mbLen < MB_FRAMESIZE) mbFrame[mbLen] = c;
+	if (mbLen < 0xFFFF) mbLen++;
+
+	// Length from the function code, writes of several registers carry a byte count
+	if (mbLen == 2)
+	{
+		if (c == MB_READHOLDING || c == MB_READINPUT || c == MB_WRITESINGLE) mbNeed = 8;
+	}
+	else if (mbLen == 7 && mbFrame[1] == MB_WRITEMULTIPLE) mbNeed = 9 + c;
+	if (mbNeed && mbLen >= mbNeed) mbframe(now);
+	return true;
+}
+
+void mb_check(millis_t now)
+{
+	if (mbLen && now - mbByteTime >= MB_GAP)
+	{
+		// Unknown function: the gap ends the frame. Half a frame of a known one is dropped.
+		if (mbNeed) mbLen = mbNeed = 0;
+		else mbframe(now);
+	}
+	if (mbActive && mbIdle && now - mbRequestTime >= mbIdle * 1000UL)
+	{
+		mbActive = false;
+		mb_mute(false);
+	}
+}
+
+void mb_start(millis_t now)
+{
+	// Take over the serial port for Modbus, also from the "modbus" command
+	mbRequestTime = now;
+	if (mbActive) return;
+	mbActive = true;
+	mb_mute(true);
+}
+
+bool mb_active()
+{
+	return mbActive;
+}
@@ -0,0 +1,104 @@
+/*
+ * Project: 12V DC Uninterruptable Power Supply
+ * File: modbus.h
+ * Author: Thorin Hopkins (topy at untergrund dot net)
+ * Copyright: (C) 2014 by Thorin Hopkins
+ * License: GNU GPL v3 (see LICENSE.txt)
+ * Web: https://github.com/Topy44/ups
+ */ 
+
+
+#ifndef MODBUS_H_
+#define MODBUS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "millis.h"
+
+// Modbus RTU subset on the serial port for polling by building management systems: read holding
+// (03) and input registers (04, same map), write single (06) and multiple registers (16), CRC-16
+// as usual, exceptions 01-03. Frames are delimited by their length (or MB_GAP of silence for
+// unknown functions) since the main loop can't time character gaps.
+//
+// A frame may start where a text command could, with a byte below 0x20 other than CR/LF (so the
+// address has to be one of those), or with any byte after the "modbus" command. From then on
+// text output is muted and every byte is taken as part of a frame, until no request for us came
+// in for MB_REG_IDLE seconds.
+//
+// Reads are served from one snapshot of the whole map taken per request (on the stack, the
+// response is streamed straight out of it). Registers are 16 bit big endian, 32 bit values take
+// two registers (high word first). The map only grows at the end, anything else bumps
+// MB_MAPVERSION. Channels past BAT_CHANNELS read 0.
+//
+// The protocol part doesn't touch the hardware, tools/mbpoll.cpp runs it on the host.
+
+// -- Constants
+#define MB_ADDRESS 1			// Default slave address
+#define MB_MAXADDRESS 0x1F		// Higher addresses would be taken for text once idle
+#define MB_IDLE 60				// Default seconds without requests until text output resumes
+#define MB_GAP 20				// ms, ends a frame of unknown length
+#define MB_FRAMESIZE 40			// Longest request: write of 15 registers
+#define MB_MAXREAD 125			// Registers per read, as in the spec
+#define MB_MAGIC 0x5550			// "UP"
+#define MB_MAPVERSION 1
+#define MB_MAXCHANNELS 8
+
+// -- Function codes and exceptions
+#define MB_READHOLDING 0x03
+#define MB_READINPUT 0x04
+#define MB_WRITESINGLE 0x06
+#define MB_WRITEMULTIPLE 0x10
+#define MB_EXFUNCTION 0x01
+#define MB_EXADDRESS 0x02
+#define MB_EXVALUE 0x03
+
+// -- Register map
+#define MB_REG_MAGIC 0
+#define MB_REG_VERSION 1		// MB_MAPVERSION
+#define MB_REG_FIRMWARE 2		// Major << 8 | minor << 4 | patch
+#define MB_REG_CHANNELS 3		// Battery channels
+#define MB_REG_FLAGS 4			// STATE_* (usvfirmware.h)
+#define MB_REG_ALARMS 5			// Bit 0: low, bit 1: very low
+#define MB_REG_UPTIME 6			// s, 32 bit
+#define MB_REG_CHARGESTATE 8	// CHG_* (charge.h)
+#define MB_REG_CHARGING 9		// Bit n: battery n+1 charging
+#define MB_REG_CHARGEETA 10		// min, CHG_ETAUNKNOWN if unknown
+#define MB_REG_RESTARTS 11		// Charger restarts, this ext. power period
+#define MB_REG_FANDUTY 12		// 0-255
+#define MB_REG_FANREMAIN 13		// s of timed run left, 0xFFFF while forced on
+#define MB_REG_ADCPOLICY 14		// ADC_* (adc.h)
+#define MB_REG_STACK 15			// Stack headroom, bytes
+#define MB_REG_MV 16			// mV per channel (signed)
+#define MB_REG_RAW 24			// ADC result per channel, 0 - 1023
+#define MB_REG_SOC 32			// % per channel
+#define MB_REG_RATE 40			// Charge rate per channel, mV/h (signed)
+#define MB_REG_OUTAGES 48		// Ext. power outages since start
+#define MB_REG_OUTAGETIME 49	// s, 32 bit
+#define MB_REG_LONGEST 51		// s, 32 bit
+#define MB_REG_BATTERYTIME 53	// s on battery with output on, 32 bit
+#define MB_REG_DROPS 55			// Output lines dropped, all lanes
+#define MB_REG_RELAYOPS 56		// Operations per relay (RELAY_*)
+#define MB_REG_RELAYMAX 59		// Longest settle time per relay, us
+#define MB_REG_TIMEOUTS 62		// Relay steps without response, all relays
+#define MB_REG_FRAMES 63		// Requests answered
+#define MB_REG_ADDRESS 64		// Writable: slave address, 1-31 except 10 and 13 (see above)
+#define MB_REG_IDLE 65			// Writable: s until text output resumes, 0 = never
+#define MB_REG_HEARTBEAT 66		// Writable: status heartbeat, ms (>= 100)
+#define MB_REG_WINDOW 67		// Writable: statistics window, ms (>= STATS_MINWINDOW)
+#define MB_REGS 68
+#define MB_REG_CONFIG MB_REG_ADDRESS	// First writable register
+
+// -- Prototypes
+bool mb_receive(uint8_t c, millis_t now);
+void mb_check(millis_t now);
+void mb_start(millis_t now);
+bool mb_active();
+uint16_t mb_crc(const uint8_t *buf, uint8_t len);
+
+// Provided by the firmware (or the host harness)
+void mb_snapshot(uint16_t *regs);
+uint8_t mb_write(uint16_t reg, uint16_t value, bool apply);	// Returns 0 or an exception code
+void mb_send(const uint8_t *frame, uint8_t len);
+void mb_mute(bool mute);
+
+#endif /* MODBUS_H_ */
@@ -0,0 +1,133 @@
+/*
+ * Project: 12V DC Uninterruptable Power Supply
+ * File: relay.cpp
+ * Author: Thorin Hopkins (topy at untergrund dot net)
+ * Copyright: (C) 2014 by Thorin Hopkins
+ * License: GNU GPL v3 (see LICENSE.txt)
+ * Web: https://github.com/Topy44/ups
+ */ 
+
+#include <stdlib.h>
+#include <avr/io.h>
+
+#include "global.h"
+#include "pins.h"
+#include "relay.h"
+#include "adc.h"
+#include "battery.h"
+#include "trace.h"
+#include "millis.h"
+
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+#include <stdio.h>
+#include <string.h>
+#include "iomacros.h"
+
+static_assert(MILLIS_TIMER == MILLIS_TIMER1 && MILLIS_TIMER1_PRESCALER == 1, "relaysettle() counts TCNT1 as CPU cycles");
+static_assert(RELAY_MINSETTLE < RELAY_MAXSETTLE, "Relay dwell has to fit in the settle time");
+
+static relaystats relayStats[RELAYS][2];	// Off, on
+
+static void relayset(uint8_t relay, bool state)
+{
+	switch (relay)
+	{
+		case RELAY_CHARGE:
+			if (state) on(CHARGESEL);
+			else off(CHARGESEL);
+			break;
+		case RELAY_SOURCE1:
+			if (state) on(SOURCESEL1);
+			else off(SOURCESEL1);
+			break;
+		case RELAY_SOURCE2:
+			if (state) on(SOURCESEL2);
+			else off(SOURCESEL2);
+			break;
+	}
+}
+
+static uint16_t relaysettle()
+{
+	// Poll the top battery tap, returns the settle time in us or 0 if nothing happened in time.
+	// Time comes from TIMER1 (millis, CTC at 1ms), interrupts are off so it has to be unwrapped here.
+	uint16_t top = OCR1A + 1;
+	uint16_t last = TCNT1;
+	uint32_t ticks = 0;
+	uint32_t moveTicks = 0;
+	uint16_t ref = adc_probe(BATCHANNELS[0].adc);
+	uint16_t prev = ref;
+	bool moved = false;
+	uint8_t stable = 0;
+
+	while (ticks < RELAY_MAXSETTLE * (F_CPU / 1000000UL))
+	{
+		uint16_t v = adc_probe(BATCHANNELS[0].adc);
+		uint16_t now = TCNT1;
+		ticks += now >= last ? now - last : now + top - last;
+		last = now;
+
+		if (!moved)
+		{
+			moved = abs((int16_t)(v - ref)) >= RELAY_STEP;
+			moveTicks = ticks;
+		}
+		else if (abs((int16_t)(v - prev)) <= RELAY_BAND)
+		{
+			// Contacts can still bounce, only settled after the dwell
+			if (stable < RELAY_STABLE) stable++;
+			if (stable >= RELAY_STABLE && ticks - moveTicks >= RELAY_MINSETTLE * (F_CPU / 1000000UL)) return ticks / (F_CPU / 1000000UL);
+		}
+		else stable = 0;
+		prev = v;
+	}
+	return 0;
+}
+
+void relay_switch(uint8_t relay, bool state)
+{
+	// Call with interrupts off. Switches one relay and waits until it settled.
+	relayset(relay, state);
+	trace(TR_RELAY, relay << 1 | state);
+
+	adc_suspend();
+	uint16_t us = relaysettle();
+	adc_resume();
+
+	relaystats *st = &relayStats[relay][state];
+	if (st->ops < 0xFFFF) st->ops++;
+	st->last = us;
+	if (us == 0)
+	{
+		if (st->timeouts < 0xFFFF) st->timeouts++;
+		return;
+	}
+	if (st->min == 0 || us < st->min) st->min = us;
+	if (us > st->max) st->max = us;
+	st->sum += us;
+}
+
+void relay_getstats(uint8_t relay, bool state, relaystats *st)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		memcpy(st, &relayStats[relay][state], sizeof(relaystats));
+	}
+}
+
+void relay_report()
+{
+	static const char names[RELAYS][8] PROGMEM = { "charge", "source1", "source2" };
+	for (uint8_t i = 0; i < RELAYS; i++)
+	{
+		for (uint8_t s = 0; s < 2; s++)
+		{
+			relaystats st;
+			relay_getstats(i, s, &st);
+			uint16_t seen = st.ops - st.timeouts;
+			printf_P(PSTR("RELAY %S %S ops=%u timeouts=%u last=%u min=%u max=%u mean=%lu\r\n"), names[i], s ? PSTR("on") : PSTR("off"),
+				st.ops, st.timeouts, st.last, seen ? st.min : 0, st.max, seen ? st.sum / seen : 0);
+		}
+	}
+}
@@ -0,0 +1,52 @@
+/*
+ * Project: 12V DC Uninterruptable Power Supply
+ * File: relay.h
+ * Author: Thorin Hopkins (topy at untergrund dot net)
+ * Copyright: (C) 2014 by Thorin Hopkins
+ * License: GNU GPL v3 (see LICENSE.txt)
+ * Web: https://github.com/Topy44/ups
+ */ 
+
+
+#ifndef RELAY_H_
+#define RELAY_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Relay sequencing. A step switches one relay and returns as soon as it has settled instead of
+// after a fixed delay: the ADC polls the top battery tap until it moved by RELAY_STEP (the stack
+// changes with CHARGESEL, load transfer sags the batteries) and then stayed within RELAY_BAND for
+// RELAY_STABLE samples, but not before RELAY_MINSETTLE after the response so contact bounce has
+// died down. Steps without a visible response end after RELAY_MAXSETTLE. Settle times
+// are kept per relay and direction as wear and aging data ("relay" command).
+
+// -- Relays (same numbers as TR_RCHARGE etc.)
+#define RELAY_CHARGE 0
+#define RELAY_SOURCE1 1
+#define RELAY_SOURCE2 2
+#define RELAYS 3
+
+// -- Settle detection
+#define RELAY_MAXSETTLE 5000	// us, upper bound per step (the old fixed delay)
+#define RELAY_MINSETTLE 1000	// us, dwell after the response, contact bounce of small power relays is specified up to 1ms
+#define RELAY_STEP 4			// ADC counts at the pin that count as a response
+#define RELAY_BAND 2			// ADC counts, max. difference between stable samples
+#define RELAY_STABLE 3			// Stable samples in a row
+
+struct relaystats
+{
+	uint16_t ops;		// Switch operations in this direction
+	uint16_t timeouts;	// No response within RELAY_MAXSETTLE
+	uint16_t last;		// us, 0 after a timeout
+	uint16_t min;		// us, over responding operations
+	uint16_t max;
+	uint32_t sum;
+};
+
+// -- Prototypes
+void relay_switch(uint8_t relay, bool state);
+void relay_getstats(uint8_t relay, bool state, relaystats *st);
+void relay_report();
+
+#endif /* RELAY_H_ */
@@ -5,19 +5,101 @@ Licensed under GPLv3
 
 #include "bitset.h"
 #include "serial.h"
+#include "trace.h"
 #include <avr/interrupt.h>
 
 #ifndef whateveridontevencare
 #define whateveridontevencare 0
 #endif
 
-volatile int recBuffer[RECBUF_SIZE];      // Empfangsbuffer
-volatile uint16_t recReadIndex;            // Leseindex
-volatile uint16_t recWriteIndex;          // Schreibindex
+volatile uint8_t recBuffer[RECBUF_SIZE];  // Empfangsbuffer
+volatile uint8_t recReadIndex;            // Leseindex
+volatile uint8_t recWriteIndex;           // Schreibindex
 
-#define UBRR_VAL ((F_CPU+BAUD*8)/(BAUD*16)-1);
+// One ring per output lane. The ISR sends up to commit, which is moved at the end of each line
+// (or when a line doesn't fit), so it never starts a line that is still being written.
+struct lane {
+    volatile uint8_t *buf;
+    uint8_t mask;
+    volatile uint8_t read;
+    volatile uint8_t commit;
+    uint8_t write;
+    uint8_t policy;
+    uint8_t dropping;   // Skipping the rest of a dropped line
+    uint8_t stalled;    // Current line had to wait for room
+    uint8_t peak;
+    uint16_t frames;
+    uint16_t drops;
+    uint16_t stalls;
+};
+
+static volatile uint8_t txAlarm[TXBUF_ALARM];
+static volatile uint8_t txStatus[TXBUF_STATUS];
+static volatile uint8_t txBulk[TXBUF_BULK];
+static struct lane lanes[LANES] = {
+    { txAlarm, TXBUF_ALARM - 1 },
+    { txStatus, TXBUF_STATUS - 1 },
+    { txBulk, TXBUF_BULK - 1, 0, 0, 0, LANE_DROP },
+};
+static volatile uint8_t txLane;     // Lane the transmitter is on
+static volatile uint8_t txFrame;    // In the middle of a line
+static uint8_t rawMode;             // Text muted, see s_setraw
+
+// Divider and resulting error (in 1/1000) for normal and double speed mode
+#define UBRR_NORMAL ((F_CPU+BAUD*8)/(BAUD*16)-1)
+#define UBRR_DOUBLE ((F_CPU+BAUD*4)/(BAUD*8)-1)
+#define BAUD_PERMILLE(div, ubrr) (1000*F_CPU/((div)*((ubrr)+1)*BAUD))
+#define BAUD_DIFF(x) ((x) > 1000 ? (x)-1000 : 1000-(x))
+#define BAUD_ERROR_NORMAL BAUD_DIFF(BAUD_PERMILLE(16, UBRR_NORMAL))
+#define BAUD_ERROR_DOUBLE BAUD_DIFF(BAUD_PERMILLE(8, UBRR_DOUBLE))
+
+// Prefer normal speed mode, the receiver takes more samples per bit
+#if UBRR_NORMAL <= 4095 && BAUD_ERROR_NORMAL <= BAUD_MAXERROR && (BAUD_ERROR_NORMAL <= BAUD_ERROR_DOUBLE || BAUD_ERROR_DOUBLE > BAUD_MAXERROR_2X)
+#define UBRR_VAL UBRR_NORMAL
+#define USE_2X 0
+#define BAUD_ERROR_VAL BAUD_ERROR_NORMAL
+#else
+#define UBRR_VAL UBRR_DOUBLE
+#define USE_2X 1
+#define BAUD_ERROR_VAL BAUD_ERROR_DOUBLE
+#endif
+
+#if UBRR_VAL > 4095
+#error "Baud rate out of range for this F_CPU"
+#endif
+#if USE_2X && BAUD_ERROR_VAL > BAUD_MAXERROR_2X
+#error "Baud rate error too high for this F_CPU, pick another BAUD"
+#endif
+
+static uint32_t baudRate = BAUD;
+
+static int s_putalarm(char c, FILE *stream);
+static int s_putbulk(char c, FILE *stream);
 
 static FILE uart_stdio = FDEV_SETUP_STREAM(s_putchr, s_getchr, _FDEV_SETUP_RW);
+FILE s_alarm = FDEV_SETUP_STREAM(s_putalarm, NULL, _FDEV_SETUP_WRITE);
+FILE s_bulk = FDEV_SETUP_STREAM(s_putbulk, NULL, _FDEV_SETUP_WRITE);
+
+// Next byte to send: finish the current line, then take the highest priority lane with
+// complete lines queued. A line longer than its lane goes out in pieces (see s_lput), the
+// transmitter waits on that lane for the rest instead of splicing other lines into it.
+// Returns -1 if there is nothing to send.
+static int s_txnext(void)
+{
+    struct lane *l = &lanes[txLane];
+    if(!txFrame || l->read == l->commit) {
+        if(txFrame && l->stalled) return -1;
+        uint8_t i = 0;
+        while(i < LANES && lanes[i].read == lanes[i].commit) i++;
+        if(i == LANES) return -1;
+        txLane = i;
+        l = &lanes[i];
+    }
+    uint8_t c = l->buf[l->read];
+    l->read = (l->read + 1) & l->mask;
+    txFrame = (c != '\n');
+    return c;
+}
 
 #if defined(__AVR_ATmega8__)
 ISR(USART_RXC_vect)
@@ -26,10 +108,12 @@ ISR(USART_RX_vect)
 #endif
 {
 #if defined(__AVR_ATmega8__)
-    recBuffer[recWriteIndex] = UDR;
+    uint8_t c = UDR;
 #elif defined(__AVR_ATmega328P__)
-    recBuffer[recWriteIndex] = UDR0;
+    uint8_t c = UDR0;
 #endif
+    recBuffer[recWriteIndex] = c;
+    trace(TR_RX, c);
     if(recWriteIndex == RECBUF_SIZE-1) {
         recWriteIndex = 0;
     } else {
@@ -37,35 +121,250 @@ ISR(USART_RX_vect)
     }
 }
 
+ISR(USART_UDRE_vect)
+{
+    int c = s_txnext();
+    if(c < 0) {
+        // Nothing left to send
+#if defined(__AVR_ATmega8__)
+        _CLRBIT(UCSRB, UDRIE);
+#elif defined(__AVR_ATmega328P__)
+        _CLRBIT(UCSR0B, UDRIE0);
+#endif
+        trace(TR_TXIDLE, 0);
+        return;
+    }
+#if defined(__AVR_ATmega8__)
+    UDR = c;
+#elif defined(__AVR_ATmega328P__)
+    UDR0 = c;
+#endif
+}
+
+// Move one byte out by polling, for when a lane is full and interrupts are off
+static void s_txpoll(void)
+{
+    int c = s_txnext();
+    if(c < 0) {
+        // Waiting for the rest of a line whose writer we interrupted, let the full lane out first
+        txFrame = 0;
+        c = s_txnext();
+        if(c < 0) return;
+    }
+#if defined(__AVR_ATmega8__)
+    loop_until_bit_is_set(UCSRA, UDRE);
+    UDR = c;
+#elif defined(__AVR_ATmega328P__)
+    loop_until_bit_is_set(UCSR0A, UDRE0);
+    UDR0 = c;
+#endif
+}
+
+// Hand everything up to write to the transmitter
+static void s_commit(struct lane *l)
+{
+    if(l->commit == l->write) return;
+    l->commit = l->write;
+    // Clear TXC, it gets set again once this byte has left (see serial_setbaud)
+#if defined(__AVR_ATmega8__)
+    UCSRA = (UCSRA & _UV(U2X)) | _UV(TXC);
+    _SETBIT(UCSRB, UDRIE);
+#elif defined(__AVR_ATmega328P__)
+    UCSR0A = (UCSR0A & _UV(U2X0)) | _UV(TXC0);
+    _SETBIT(UCSR0B, UDRIE0);
+#endif
+}
+
+// Wait for room in a full lane. The UDRE interrupt drains it unless interrupts are off
+static void s_lwait(struct lane *l, uint8_t next) {
+    s_commit(l);
+    while(next == l->read) {
+        if(!(SREG & _UV(SREG_I))) s_txpoll();
+    }
+}
+
+static int s_lput(uint8_t lane, char c) {
+    struct lane *l = &lanes[lane];
+    uint8_t backlog = (l->write - l->read) & l->mask;
+
+    if(rawMode) return whateveridontevencare;
+
+    if(l->dropping) {
+        if(c == '\n') l->dropping = 0;
+        return whateveridontevencare;
+    }
+    if(l->write == l->commit && !l->stalled && l->policy == LANE_DROP && backlog > l->mask / 2) {
+        // New line while the lane is backed up, drop all of it
+        l->drops++;
+        l->dropping = (c != '\n');
+        return whateveridontevencare;
+    }
+
+    uint8_t next = (l->write + 1) & l->mask;
+    if(next == l->read) {
+        // Lane full, let the line out as far as it goes
+        if(!l->stalled) l->stalls++;
+        l->stalled = 1;
+        s_lwait(l, next);
+    }
+    l->buf[l->write] = c;
+    l->write = next;
+    backlog = (l->write - l->read) & l->mask;
+    if(backlog > l->peak) l->peak = backlog;
+    if(c == '\n') {
+        l->frames++;
+        l->stalled = 0;
+        s_commit(l);
+    }
+    return whateveridontevencare;
+}
+
 void serial_init(void)
 {
     recReadIndex = recWriteIndex = 0;
+    for(uint8_t i = 0; i < LANES; i++) lanes[i].read = lanes[i].commit = lanes[i].write = 0;
+    txLane = txFrame = 0;
 #if defined(__AVR_ATmega8__)
     UCSRB = _UV(TXEN) | _UV(RXEN) | _UV(RXCIE); // tx/rx enabled, rx interrupt
     UCSRC = _UV(URSEL) | _UV(UCSZ1) | _UV(UCSZ0); // 8 bit, no parity, 1 stop
-    UBRRL = UBRR_VAL;
+    UBRRH = UBRR_VAL >> 8;
+    UBRRL = UBRR_VAL & 0xFF;
     do{UDR;}while (UCSRA & (1 << RXC));
-    UCSRA = (1 << TXC) | (1 << RXC);
+    UCSRA = (1 << TXC) | (1 << RXC) | (USE_2X << U2X);
 #elif defined(__AVR_ATmega328P__)
     UCSR0B = _UV(TXEN0) | _UV(RXEN0) | _UV(RXCIE0); // tx/rx enabled, rx interrupt
     UCSR0C = _UV(UCSZ01) | _UV(UCSZ00); // 8 bit, no parity, 1 stop
     UBRR0 = UBRR_VAL;
     do{UDR0;}while (UCSR0A & (1 << RXC0));
-    UCSR0A = (1 << TXC0) | (1 << RXC0);
+    UCSR0A = (1 << TXC0) | (1 << RXC0) | (USE_2X << U2X0);
 #endif
+    baudRate = BAUD;
     stdout = &uart_stdio;
     stdin = &uart_stdio;
 }
 
-int s_putchr(char c, FILE *stream) {
+// Divider for a baud rate, picks normal or double speed mode like the compile time setup.
+// Returns 0xFFFF if the rate can't be hit within BAUD_MAXERROR (BAUD_MAXERROR_2X with U2X).
+static uint16_t s_baudcalc(uint32_t baud, uint8_t *u2x) {
+    if(baud == 0 || baud > F_CPU/8) return 0xFFFF;
+    uint32_t ubrr = (F_CPU+baud*4)/(baud*8)-1;
+    uint32_t normal = (F_CPU+baud*8)/(baud*16)-1;
+    long error = (long)(1000*(F_CPU/8)/((ubrr+1)*baud))-1000;
+    long normalError = (long)(1000*(F_CPU/16)/((normal+1)*baud))-1000;
+    if(error < 0) error = -error;
+    if(normalError < 0) normalError = -normalError;
+    if(normal <= 4095 && normalError <= BAUD_MAXERROR && (normalError <= error || error > BAUD_MAXERROR_2X)) {
+        *u2x = 0;
+        return normal;
+    }
+    *u2x = 1;
+    if(ubrr > 4095 || error > BAUD_MAXERROR_2X) return 0xFFFF;
+    return ubrr;
+}
+
+int serial_baudok(uint32_t baud) {
+    uint8_t u2x;
+    return (s_baudcalc(baud, &u2x) != 0xFFFF);
+}
+
+// Switch baud rate at runtime. Waits until all pending output has left the UART.
+// Returns 0 and keeps the current rate if the new one is not possible.
+int serial_setbaud(uint32_t baud) {
+    uint8_t u2x;
+    uint16_t ubrr = s_baudcalc(baud, &u2x);
+    if(ubrr == 0xFFFF) return 0;
+
+    while(!s_txempty()) {}
 #if defined(__AVR_ATmega8__)
-	loop_until_bit_is_set(UCSRA, UDRE);
-        UDR = c;
+    loop_until_bit_is_set(UCSRA, TXC);
+    UBRRH = ubrr >> 8;
+    UBRRL = ubrr & 0xFF;
+    UCSRA = (1 << TXC) | (u2x << U2X);
 #elif defined(__AVR_ATmega328P__)
-	loop_until_bit_is_set(UCSR0A, UDRE0);
-        UDR0 = c;
+    loop_until_bit_is_set(UCSR0A, TXC0);
+    UBRR0 = ubrr;
+    UCSR0A = (1 << TXC0) | (u2x << U2X0);
 #endif
-	return whateveridontevencare;
+    baudRate = baud;
+    return 1;
+}
+
+uint32_t serial_getbaud(void) {
+    return baudRate;
+}
+
+int s_putchr(char c, FILE *stream) {
+    return s_lput(LANE_STATUS, c);
+}
+
+static int s_putalarm(char c, FILE *stream) {
+    return s_lput(LANE_ALARM, c);
+}
+
+static int s_putbulk(char c, FILE *stream) {
+    return s_lput(LANE_BULK, c);
+}
+
+// Room in the status lane
+uint8_t s_txfree(void) {
+    struct lane *l = &lanes[LANE_STATUS];
+    return (l->read - l->write - 1) & l->mask;
+}
+
+// All lanes sent. Unfinished lines go out as they are, whoever waits for this isn't adding to them.
+int s_txempty(void) {
+    uint8_t empty = 1;
+    for(uint8_t i = 0; i < LANES; i++) {
+        s_commit(&lanes[i]);
+        if(lanes[i].read != lanes[i].write) empty = 0;
+    }
+    return empty;
+}
+
+int s_laneempty(uint8_t lane) {
+    return (lanes[lane].read == lanes[lane].write);
+}
+
+void s_setpolicy(uint8_t lane, uint8_t policy) {
+    lanes[lane].policy = policy;
+}
+
+void s_getlane(uint8_t lane, struct lanestats *st) {
+    struct lane *l = &lanes[lane];
+    st->size = l->mask + 1;
+    st->policy = l->policy;
+    st->peak = l->peak;
+    st->frames = l->frames;
+    st->drops = l->drops;
+    st->stalls = l->stalls;
+}
+
+// Switch raw mode. Going raw drops all text that hasn't left yet, the frames that follow
+// shouldn't be mixed up with the tail of a line.
+void s_setraw(uint8_t raw) {
+    uint8_t sreg = SREG;
+    cli();
+    if(raw && !rawMode) {
+        for(uint8_t i = 0; i < LANES; i++) {
+            lanes[i].read = lanes[i].commit = lanes[i].write;
+            lanes[i].dropping = lanes[i].stalled = 0;
+        }
+        txFrame = 0;
+    }
+    rawMode = raw;
+    SREG = sreg;
+}
+
+// Binary data on the alarm lane, regardless of its policy. Goes out right away.
+void s_putframe(const uint8_t *buf, uint8_t len) {
+    struct lane *l = &lanes[LANE_ALARM];
+    while(len--) {
+        uint8_t next = (l->write + 1) & l->mask;
+        if(next == l->read) s_lwait(l, next);
+        l->buf[l->write] = *buf++;
+        l->write = next;
+    }
+    s_commit(l);
 }
 
 int s_hasdata(void) {
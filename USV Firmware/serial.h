@@ -8,25 +8,75 @@ Licensed under GPLv3
 
 #include <stdio.h>
 
-#define BAUD 115200UL
+// Default baud rate. 250000, 500000 and 1000000 are exact at 16MHz, 115200 is off by 2.1% with U2X
+// and no longer passes the error check
+#ifndef BAUD
+#define BAUD 500000UL
+#endif
+
+// Max. baud rate error (in 1/1000), datasheet recommendation for the receiver. U2X takes fewer
+// samples per bit and tolerates less.
+#define BAUD_MAXERROR 20
+#define BAUD_MAXERROR_2X 15
+
+#define RECBUF_SIZE 32
+
+// Output lanes, highest priority first. The transmitter only switches lanes at the end of a
+// line (frame), so an alarm waits for at most one line of routine output. Lines longer than
+// their lane are let out in pieces and still not mixed with others. Sizes must be powers of 2.
+// stdout goes to the status lane.
+#define LANE_ALARM 0
+#define LANE_STATUS 1
+#define LANE_BULK 2
+#define LANES 3
 
-#define RECBUF_SIZE 8
+#define TXBUF_ALARM 32
+#define TXBUF_STATUS 64
+#define TXBUF_BULK 32
+
+// Lane policies: block the writer until there is room, or drop new lines while the lane is more than half full
+#define LANE_BLOCK 0
+#define LANE_DROP 1
+
+// In raw mode (Modbus, see modbus.h) text output is thrown away and binary frames go out on the
+// alarm lane with s_putframe().
 
 // No idea why this is needed
 #ifdef __cplusplus
 extern "C" {
 #endif
 	
-extern volatile int recBuffer[RECBUF_SIZE];
-extern volatile uint16_t recReadIndex;
-extern volatile uint16_t recWriteIndex;
+extern volatile uint8_t recBuffer[RECBUF_SIZE];
+extern volatile uint8_t recReadIndex;
+extern volatile uint8_t recWriteIndex;
+
+extern FILE s_alarm;	// Streams for the alarm and bulk lanes
+extern FILE s_bulk;
 
-//static FILE uart_stdio;
+struct lanestats
+{
+    uint8_t size;
+    uint8_t policy;
+    uint8_t peak;       // Highest backlog seen
+    uint16_t frames;
+    uint16_t drops;     // Lines dropped by LANE_DROP
+    uint16_t stalls;    // Lines that had to wait for room
+};
 
 void serial_init(void);
+int serial_baudok(uint32_t baud);
+int serial_setbaud(uint32_t baud);
+uint32_t serial_getbaud(void);
 int s_putchr(char c, FILE *stream);
 int s_getchr(FILE *stream);
 int s_hasdata(void);
+uint8_t s_txfree(void);
+int s_txempty(void);
+int s_laneempty(uint8_t lane);
+void s_setpolicy(uint8_t lane, uint8_t policy);
+void s_getlane(uint8_t lane, struct lanestats *st);
+void s_setraw(uint8_t raw);
+void s_putframe(const uint8_t *buf, uint8_t len);
 
 #ifdef __cplusplus
 }
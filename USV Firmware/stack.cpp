@@ -0,0 +1,48 @@
+/*
+ * Project: 12V DC Uninterruptable Power Supply
+ * File: stack.cpp
+ * Author: Thorin Hopkins (topy at untergrund dot net)
+ * Copyright: (C) 2014 by Thorin Hopkins
+ * License: GNU GPL v3 (see LICENSE.txt)
+ * Web: https://github.com/Topy44/ups
+ */ 
+
+#include <avr/io.h>
+
+#include "stack.h"
+
+extern uint8_t _end;	// End of .bss/.noinit, start of heap (provided by linker)
+extern uint8_t __stack;	// Top of stack (RAMEND)
+
+// Fill free RAM with canary bytes before the C runtime starts so stack_unused() can find the high water mark
+void stack_paint() __attribute__((naked, used, section(".init3")));
+void stack_paint()
+{
+	asm volatile (
+		"	ldi r30, lo8(_end)\n"
+		"	ldi r31, hi8(_end)\n"
+		"	ldi r24, %0\n"
+		"	ldi r25, hi8(__stack)\n"
+		"	rjmp 2f\n"
+		"1:	st Z+, r24\n"
+		"2:	cpi r30, lo8(__stack)\n"
+		"	cpc r31, r25\n"
+		"	brlo 1b\n"
+		"	breq 1b\n"
+		:: "M" (STACKCANARY));
+}
+
+uint16_t stack_unused()
+{
+	// Count canary bytes the stack has never overwritten
+	const uint8_t *p = &_end;
+	uint16_t count = 0;
+
+	while (p <= &__stack && *p == STACKCANARY)
+	{
+		p++;
+		count++;
+	}
+
+	return count;
+}
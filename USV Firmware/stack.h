@@ -0,0 +1,21 @@
+/*
+ * Project: 12V DC Uninterruptable Power Supply
+ * File: stack.h
+ * Author: Thorin Hopkins (topy at untergrund dot net)
+ * Copyright: (C) 2014 by Thorin Hopkins
+ * License: GNU GPL v3 (see LICENSE.txt)
+ * Web: https://github.com/Topy44/ups
+ */ 
+
+
+#ifndef STACK_H_
+#define STACK_H_
+
+#include <stdint.h>
+
+#define STACKCANARY 0xC5	// Free RAM is painted with this at reset
+
+// -- Prototypes
+uint16_t stack_unused();
+
+#endif /* STACK_H_ */
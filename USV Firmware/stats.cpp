@@ -0,0 +1,224 @@
+/*
+ * Project: 12V DC Uninterruptable Power Supply
+ * File: stats.cpp
+ * Author: Thorin Hopkins (topy at untergrund dot net)
+ * Copyright: (C) 2014 by Thorin Hopkins
+ * License: GNU GPL v3 (see LICENSE.txt)
+ * Web: https://github.com/Topy44/ups
+ */ 
+
+#include <avr/io.h>
+
+#include "global.h"
+#include "pins.h"
+
+#include "stats.h"
+#include "battery.h"
+#include "adc.h"
+#include "tele.h"
+#include "fmt.h"
+
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+#include <stdio.h>
+#include <string.h>
+#include "millis.h"
+#include "iomacros.h"
+
+struct statacc
+{
+	uint16_t count;
+	int16_t min;		// Battery value in 1/ADC_SCALE LSB of its input
+	int16_t max;
+	int16_t shift;		// First sample of the window
+	int32_t sum;		// Sum of (x - shift)
+	uint32_t sumsq;		// Sum of (x - shift)^2, low 32 bits
+	uint16_t sumsqHigh;	// Carries out of sumsq
+};
+
+struct statwin
+{
+	uint16_t count;
+	int16_t min;		// mV
+	int16_t max;
+	int16_t mean;
+	uint16_t sd;
+};
+
+static statacc statLive[BAT_CHANNELS];		// Written by the ADC ISR
+static statwin statLast[BAT_CHANNELS];		// Last closed window
+static uint16_t statScale[BAT_CHANNELS];	// Input of the battery below in this input's LSB, 4.12 fixed point
+static uint16_t statWindow = STATS_WINDOW;
+static uint16_t statLastWindow;
+static millis_t statTimer;
+static uint8_t statSeq;
+
+// Outage and time on battery, since start
+static bool statExt = true;
+static millis_t statPowerTime;
+static uint16_t outageCount;
+static uint32_t outageTime;
+static uint32_t outageCurrent;
+static uint32_t outageLongest;
+static uint32_t batteryTime;
+
+constexpr bool stats_scaleok(uint8_t ch)
+{
+	return ch == BAT_CHANNELS || ((BATCHANNELS[ch].below == BAT_BOTTOM || bat_range(BATCHANNELS[ch].below) <= bat_range(ch)) && stats_scaleok(ch + 1));
+}
+static_assert(stats_scaleok(0), "Battery below needs a range no larger than the input above it, or differences overflow 16 bit");
+
+void stats_init()
+{
+	// Ratios of the input ranges, keeps the division out of the ISR
+	for (uint8_t i = 0; i < BAT_CHANNELS; i++)
+	{
+		uint8_t below = BATCHANNELS[i].below;
+		statScale[i] = below == BAT_BOTTOM ? 0 : ((uint32_t)bat_range(below) * 4096 + bat_range(i) / 2) / bat_range(i);
+	}
+}
+
+static inline void statadd(statacc *a, int16_t v)
+{
+	if (a->count == 0)
+	{
+		a->shift = v;
+		a->min = v;
+		a->max = v;
+	}
+	else if (a->count == 0xFFFF) return;	// Saturated, window too long
+
+	int16_t d = v - a->shift;
+	a->sum += d;
+	uint32_t sq = (int32_t)d * d;
+	a->sumsq += sq;
+	if (a->sumsq < sq) a->sumsqHigh++;
+	if (v < a->min) a->min = v;
+	if (v > a->max) a->max = v;
+	a->count++;
+}
+
+void stats_sample(const uint16_t *results)
+{
+	// Called from the ADC ISR for every completed sample set. Stays in ADC units, only the battery
+	// below is taken off in series mode (as in bat_convert()), one 16 bit multiply per channel.
+	bool stacked = !get(CHARGESEL);
+	for (uint8_t i = 0; i < BAT_CHANNELS; i++)
+	{
+		int16_t v = results[i];
+		uint8_t below = BATCHANNELS[i].below;
+		if (stacked && below != BAT_BOTTOM) v -= ((uint32_t)results[below] * statScale[i] + 2048) >> 12;
+		statadd(&statLive[i], v);
+	}
+}
+
+static uint16_t statsqrt(uint32_t v)
+{
+	uint32_t r = 0;
+	uint32_t bit = 1UL << 30;
+	while (bit > v) bit >>= 2;
+	while (bit)
+	{
+		if (v >= r + bit)
+		{
+			v -= r + bit;
+			r = (r >> 1) + bit;
+		}
+		else r >>= 1;
+		bit >>= 2;
+	}
+	return r;
+}
+
+static int16_t statmv(int32_t v, uint16_t range)
+{
+	// ADC units of an input to mV, signed as differences can go below 0
+	return v * range / (1024L*ADC_SCALE);
+}
+
+static void statclose(const statacc *a, statwin *w, uint16_t range)
+{
+	// Mean and standard deviation of a window, in mV from here on
+	w->count = a->count;
+	if (a->count == 0) return;
+	int32_t mean = a->shift + (a->sum + (a->sum >= 0 ? a->count / 2 : -(a->count / 2))) / a->count;
+	uint64_t sumsq = (uint64_t)a->sumsqHigh << 32 | a->sumsq;
+	uint64_t square = (uint64_t)((int64_t)a->sum * a->sum) / a->count;
+	uint32_t var = sumsq > square ? (sumsq - square) / a->count : 0;
+	w->min = statmv(a->min, range);
+	w->max = statmv(a->max, range);
+	w->mean = statmv(mean, range);
+	w->sd = bat_mv(statsqrt(var), range);
+}
+
+void stats_update(bool ext, bool battery)
+{
+	millis_t now = millis();
+
+	// Power counters
+	uint32_t dt = now - statPowerTime;
+	statPowerTime = now;
+	if (statExt && !ext)
+	{
+		outageCount++;
+		outageCurrent = 0;
+	}
+	statExt = ext;
+	if (!ext)
+	{
+		outageTime += dt;
+		outageCurrent += dt;
+		if (outageCurrent > outageLongest) outageLongest = outageCurrent;
+	}
+	if (battery) batteryTime += dt;
+
+	// Close the window
+	if (now - statTimer < statWindow) return;
+	statLastWindow = now - statTimer;
+	statTimer = now;
+	statacc acc[BAT_CHANNELS];
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		memcpy(acc, statLive, sizeof(acc));
+		memset(statLive, 0, sizeof(statLive));
+	}
+	for (uint8_t i = 0; i < BAT_CHANNELS; i++) statclose(&acc[i], &statLast[i], bat_range(i));
+	statSeq++;
+	if (tele_due(TELE_STA, statSeq, 0)) stats_report();
+}
+
+void stats_setwindow(uint16_t window)
+{
+	statWindow = window;
+}
+
+uint16_t stats_window()
+{
+	return statWindow;
+}
+
+void stats_getpower(statpower *p)
+{
+	p->outages = outageCount;
+	p->outageTime = outageTime;
+	p->outageLongest = outageLongest;
+	p->batteryTime = batteryTime;
+}
+
+void stats_report()
+{
+	millis_t now = millis();
+	char buf1[FMTBUF_SIZE], buf2[FMTBUF_SIZE], buf3[FMTBUF_SIZE];
+	for (uint8_t i = 0; i < BAT_CHANNELS; i++)
+	{
+		statwin *w = &statLast[i];
+		if (w->count == 0)
+		{
+			printf_P(PSTR("STAT t=%lu win=%u b%u n=0\r\n"), now, statLastWindow, i + 1);
+			continue;
+		}
+		printf_P(PSTR("STAT t=%lu win=%u b%u n=%u min=%s max=%s mean=%s sd=%umV\r\n"), now, statLastWindow, i + 1, w->count,
+			fmt_mv(buf1, w->min), fmt_mv(buf2, w->max), fmt_mv(buf3, w->mean), w->sd);
+	}
+	printf_P(PSTR("STAT t=%lu outages=%u outage=%lus longest=%lus battery=%lus\r\n"), now, outageCount, outageTime / 1000, outageLongest / 1000, batteryTime / 1000);
+}
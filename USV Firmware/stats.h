@@ -0,0 +1,45 @@
+/*
+ * Project: 12V DC Uninterruptable Power Supply
+ * File: stats.h
+ * Author: Thorin Hopkins (topy at untergrund dot net)
+ * Copyright: (C) 2014 by Thorin Hopkins
+ * License: GNU GPL v3 (see LICENSE.txt)
+ * Web: https://github.com/Topy44/ups
+ */ 
+
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Per battery min/max/mean/variance over a reporting window, updated from the ADC ISR with
+// every completed sample set. Integer only: sums are kept relative to the first sample of the
+// window (shifted data), which is as stable as Welford's update without a division in the ISR.
+// The ISR only adds raw ADC deltas in 32 bit, conversion to mV, mean and standard deviation
+// are worked out when the window closes. Outage and time on battery
+// counters run since start. Windows are published as "STAT" telemetry (group "sta").
+
+// -- Constants
+#define STATS_WINDOW 10000		// Default window (ms)
+#define STATS_MINWINDOW 1000
+
+struct statpower
+{
+	uint16_t outages;
+	uint32_t outageTime;		// ms, all outages
+	uint32_t outageLongest;		// ms
+	uint32_t batteryTime;		// ms on battery with output on
+};
+
+// -- Prototypes
+void stats_init();
+void stats_sample(const uint16_t *results);
+void stats_update(bool ext, bool battery);
+void stats_setwindow(uint16_t window);
+uint16_t stats_window();
+void stats_report();
+void stats_getpower(statpower *p);
+
+#endif /* STATS_H_ */
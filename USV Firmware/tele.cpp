@@ -0,0 +1,125 @@
+/*
+ * Project: 12V DC Uninterruptable Power Supply
+ * File: tele.cpp
+ * Author: Thorin Hopkins (topy at untergrund dot net)
+ * Copyright: (C) 2014 by Thorin Hopkins
+ * License: GNU GPL v3 (see LICENSE.txt)
+ * Web: https://github.com/Topy44/ups
+ */ 
+
+#include <stdlib.h>
+#include <avr/io.h>
+
+#include "global.h"
+#include "usvfirmware.h"
+#include "tele.h"
+
+#include <avr/pgmspace.h>
+#include <stdio.h>
+#include "millis.h"
+
+struct telegroup
+{
+	bool enabled;
+	bool sent;		// Published at least once
+	uint16_t deadband;
+	uint16_t minInterval;
+	uint16_t maxInterval;
+	millis_t lastTime;
+	int16_t last[TELE_VALUES];
+};
+
+struct teledefault
+{
+	char name[4];
+	uint16_t deadband;
+	uint16_t minInterval;
+	uint16_t maxInterval;
+};
+
+static const teledefault teleDefaults[TELE_GROUPS] PROGMEM =
+{
+	{ "pwr", TELE_PWRDEFAULT },
+	{ "bat", TELE_BATDEFAULT },
+	{ "fan", TELE_FANDEFAULT },
+	{ "chg", TELE_CHGDEFAULT },
+	{ "sta", TELE_STADEFAULT }
+};
+
+static telegroup teleGroups[TELE_GROUPS];
+static uint16_t teleHeartbeat = STATUSFREQ;
+
+void tele_init()
+{
+	for (uint8_t i = 0; i < TELE_GROUPS; i++)
+	{
+		tele_config(i, true, pgm_read_word(&teleDefaults[i].deadband), pgm_read_word(&teleDefaults[i].minInterval), pgm_read_word(&teleDefaults[i].maxInterval));
+	}
+}
+
+bool tele_due(uint8_t group, int16_t a, int16_t b)
+{
+	// Decide if a group has to be published now, remembers the values if so
+	telegroup *g = &teleGroups[group];
+	if (!g->enabled) return false;
+
+	millis_t elapsed = millis() - g->lastTime;
+	bool due = !g->sent || elapsed >= g->maxInterval;
+	if (!due && elapsed >= g->minInterval)
+	{
+		if (g->deadband == 0) due = a != g->last[0] || b != g->last[1];	// Flags, any change counts
+		else due = (uint16_t)abs(a - g->last[0]) > g->deadband || (uint16_t)abs(b - g->last[1]) > g->deadband;
+	}
+	if (!due) return false;
+
+	g->sent = true;
+	g->lastTime = millis();
+	g->last[0] = a;
+	g->last[1] = b;
+	return true;
+}
+
+int8_t tele_find(const char *name)
+{
+	for (uint8_t i = 0; i < TELE_GROUPS; i++)
+	{
+		if (strcmp_P(name, teleDefaults[i].name) == 0) return i;
+	}
+	return -1;
+}
+
+void tele_enable(uint8_t group, bool enabled)
+{
+	teleGroups[group].enabled = enabled;
+	teleGroups[group].sent = false;
+}
+
+void tele_config(uint8_t group, bool enabled, uint16_t deadband, uint16_t minInterval, uint16_t maxInterval)
+{
+	telegroup *g = &teleGroups[group];
+	g->enabled = enabled;
+	g->sent = false;	// Publish right away with the new settings
+	g->deadband = deadband;
+	g->minInterval = minInterval;
+	g->maxInterval = maxInterval;
+}
+
+uint16_t tele_heartbeat()
+{
+	return teleHeartbeat;
+}
+
+void tele_setheartbeat(uint16_t interval)
+{
+	teleHeartbeat = interval;
+}
+
+void tele_list()
+{
+	printf_P(PSTR("SUB heartbeat %u\r\n"), teleHeartbeat);
+	for (uint8_t i = 0; i < TELE_GROUPS; i++)
+	{
+		telegroup *g = &teleGroups[i];
+		printf_P(PSTR("SUB %S %S deadband=%u min=%u max=%u\r\n"), teleDefaults[i].name, g->enabled ? PSTR("on") : PSTR("off"), g->deadband, g->minInterval, g->maxInterval);
+	}
+}
@@ -0,0 +1,50 @@
+/*
+ * Project: 12V DC Uninterruptable Power Supply
+ * File: tele.h
+ * Author: Thorin Hopkins (topy at untergrund dot net)
+ * Copyright: (C) 2014 by Thorin Hopkins
+ * License: GNU GPL v3 (see LICENSE.txt)
+ * Web: https://github.com/Topy44/ups
+ */ 
+
+
+#ifndef TELE_H_
+#define TELE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Change driven telemetry. Each field group is published when one of its values moved by more
+// than the deadband (but not more often than minInterval), and at least every maxInterval.
+// Groups can be (un)subscribed and tuned at runtime with the "sub" command. The full status
+// report still goes out as a slow heartbeat. The boot phase timing (BOOT, see boot.h) goes out
+// once, right before the first PWR frame.
+
+// -- Groups
+#define TELE_PWR 0		// Power, switch, alarm and LED flags
+#define TELE_BAT 1		// Battery voltages
+#define TELE_FAN 2
+#define TELE_CHG 3		// Charger status
+#define TELE_STA 4		// Window statistics, see stats.h
+#define TELE_GROUPS 5
+
+#define TELE_VALUES 2	// Values compared per group
+
+// -- Defaults: deadband, min. interval (ms), max. interval (ms)
+#define TELE_PWRDEFAULT 0, 0, 60000
+#define TELE_BATDEFAULT 50, 200, 10000	// mV
+#define TELE_FANDEFAULT 8, 500, 60000	// Duty steps
+#define TELE_CHGDEFAULT 0, 0, 60000
+#define TELE_STADEFAULT 0, 0, 65535	// Once per window
+
+// -- Prototypes
+void tele_init();
+bool tele_due(uint8_t group, int16_t a, int16_t b);
+int8_t tele_find(const char *name);
+void tele_enable(uint8_t group, bool enabled);
+void tele_config(uint8_t group, bool enabled, uint16_t deadband, uint16_t minInterval, uint16_t maxInterval);
+uint16_t tele_heartbeat();
+void tele_setheartbeat(uint16_t interval);
+void tele_list();
+
+#endif /* TELE_H_ */
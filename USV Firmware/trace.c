@@ -0,0 +1,62 @@
+/*
+ * Project: 12V DC Uninterruptable Power Supply
+ * File: trace.c
+ * Author: Thorin Hopkins (topy at untergrund dot net)
+ * Copyright: (C) 2014 by Thorin Hopkins
+ * License: GNU GPL v3 (see LICENSE.txt)
+ * Web: https://github.com/Topy44/ups
+ */ 
+
+#include <avr/io.h>
+
+#include "global.h"
+#include "trace.h"
+
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+#include <stdio.h>
+
+struct tracerecord traceBuffer[TRACE_SIZE];
+volatile uint8_t traceIndex = 0;
+volatile uint8_t traceCount = 0;
+
+void trace_idle(void)
+{
+	// Keep gaps between records shorter than the timestamp wrap so the host can unwrap them
+	uint16_t last, now;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		last = traceBuffer[(traceIndex - 1) & (TRACE_SIZE - 1)].time;
+		now = trace_time();
+	}
+	if (traceCount == 0 || (uint16_t)(now - last) >= TRACE_TICK * 8)
+	{
+		trace(TR_TICK, millis_get() / 1000);
+	}
+}
+
+void trace_dump(void)
+{
+	// Header carries the current time so the host can anchor the records, oldest record first
+	uint8_t count, index;
+	uint16_t now;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		count = traceCount;
+		index = (traceIndex - count) & (TRACE_SIZE - 1);
+		now = trace_time();
+	}
+	printf_P(PSTR("TRACE %lu %u %u\r\n"), millis_get(), now, count);
+
+	for (uint8_t i = 0; i < count; i++)
+	{
+		struct tracerecord r;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			r = traceBuffer[(index + i) & (TRACE_SIZE - 1)];
+		}
+		printf_P(PSTR("%04x%02x%02x%S"), r.time, r.event, r.arg, ((i & 7) == 7 || i == count - 1) ? PSTR("\r\n") : PSTR(" "));
+	}
+	printf_P(PSTR("TRACE END\r\n"));
+}
@@ -0,0 +1,99 @@
+/*
+ * Project: 12V DC Uninterruptable Power Supply
+ * File: trace.h
+ * Author: Thorin Hopkins (topy at untergrund dot net)
+ * Copyright: (C) 2014 by Thorin Hopkins
+ * License: GNU GPL v3 (see LICENSE.txt)
+ * Web: https://github.com/Topy44/ups
+ */ 
+
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "millis.h"
+
+// Event trace ring in SRAM. Each record is 4 bytes: 16 bit timestamp in 1/8 ms (wraps after
+// 8.2s, trace_idle() keeps gaps shorter), event ID and one argument byte. trace() is inline
+// so ISRs don't have to save all registers for a call. Dump with the "trace" command and
+// convert with tools/trace2json.py.
+
+#if MILLIS_TIMER != MILLIS_TIMER1
+	#error "trace needs millis on TIMER1 for sub-millisecond timestamps"
+#endif
+
+// -- Constants
+#define TRACE_SIZE 64		// Records, must be a power of 2
+#define TRACE_TICK 4000		// Heartbeat after X ms without events
+
+// -- Events
+#define TR_TICK 0x01		// Heartbeat, arg: seconds since start & 0xFF
+#define TR_BOOT 0x02		// Main loop entered, arg: MCUSR
+#define TR_INT0 0x03		// INT0 ISR entry, arg: OPTO
+#define TR_INT0END 0x04		// INT0 ISR exit
+#define TR_RX 0x05			// UART byte received, arg: byte
+#define TR_TXIDLE 0x06		// UART TX buffer drained
+#define TR_RELAY 0x07		// arg: relay << 1 | state
+#define TR_SWITCH 0x08		// Mech. switch changed, arg: 1 = on
+#define TR_POWER 0x09		// Ext. power taken over after ONDELAY
+#define TR_FANRUN 0x0A		// fanrun(), arg: minutes (max 255)
+#define TR_FANSTOP 0x0B
+#define TR_FANDUTY 0x0C		// Fan target duty changed, arg: duty
+#define TR_LEDS 0x0D		// LED status changed, arg: statusA << 4 | statusB
+#define TR_CHARGE 0x0E		// arg: 0 = stop, 1 = start, 2 = charger restart, 3 = complete
+#define TR_PANIC 0x0F		// Battery critical shut-off
+#define TR_STATUS 0x10		// Status report sent
+
+// -- Relays for TR_RELAY
+#define TR_RCHARGE 0
+#define TR_RSOURCE1 1
+#define TR_RSOURCE2 2
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct tracerecord
+{
+	uint16_t time;
+	uint8_t event;
+	uint8_t arg;
+};
+
+extern struct tracerecord traceBuffer[TRACE_SIZE];
+extern volatile uint8_t traceIndex;
+extern volatile uint8_t traceCount;
+
+static inline uint16_t trace_time(void)
+{
+	// Call with interrupts off. 1/8 ms resolution, TIMER1 counts 16000 per ms in CTC mode.
+	uint16_t ticks = TCNT1;
+	uint16_t ms = (uint16_t)milliseconds;
+	if ((TIFR1 & (1<<OCF1A)) && ticks < 8000) ms++;	// Tick is pending, millis ISR did not run yet
+	return (ms << 3) | (ticks >> 11);
+}
+
+static inline void trace(uint8_t event, uint8_t arg)
+{
+	uint8_t sreg = SREG;
+	cli();
+	struct tracerecord *r = &traceBuffer[traceIndex];
+	r->time = trace_time();
+	r->event = event;
+	r->arg = arg;
+	traceIndex = (traceIndex + 1) & (TRACE_SIZE - 1);
+	if (traceCount < TRACE_SIZE) traceCount++;
+	SREG = sreg;
+}
+
+void trace_idle(void);
+void trace_dump(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TRACE_H_ */
@@ -8,6 +8,7 @@
  */ 
 
 #include <stdlib.h>
+#include <string.h>
 #include <avr/io.h>
 
 #include "global.h"
@@ -21,7 +22,23 @@
 #include <stdbool.h>
 #include "serial.h"
 #include "iomacros.h"
-#include "millis.h"		// Uses TIMER0
+#include "millis.h"		// Uses TIMER1
+#include "fan.h"		// Uses TIMER0
+#include "fmt.h"
+#include "stack.h"
+#include "crashlog.h"
+#include "boot.h"
+#include "command.h"
+#include "adc.h"
+#include "trace.h"
+#include "tele.h"
+#include "battery.h"
+#include "history.h"
+#include "stats.h"
+#include "charge.h"
+#include "relay.h"
+#include "modbus.h"
+#include <avr/pgmspace.h>
 
 enum ledstatus
 {
@@ -40,6 +57,7 @@ volatile ledstatus ledStatusB = OFF;
 volatile bool powerStatusChanged = false;
 volatile millis_t powerStatusTime = 0;
 volatile bool powerStatus = false;
+volatile bool powerLost = false;	// Set by INT0, reported from the main loop
 
 volatile uint8_t switchStatus = false;	// Needs to be uint8_t because it gets compared to a get() result
 volatile millis_t switchStatusTime = 0;
@@ -58,41 +76,32 @@ volatile millis_t adcTimer = 0;
 volatile millis_t statusTimer = 0;
 volatile millis_t ledTimer = 0;
 volatile millis_t batLowTimer = millis();
-volatile millis_t chargeTimer = 0;
 
 volatile int batLowCounter = 0;
 
 volatile bool alarm = false;
 
-int main(void)
-{
-	out(BUZ);
-	wdt_enable(WDTO_8S);	// Enable watchdog, 8 seconds
-	wdt_reset();
+bool batLowVoltage = false;
+bool batVeryLowVoltage = false;
 
-	_delay_ms(200);	// Wait a bit to escape reset loops
+int16_t batmv[BAT_CHANNELS];
+uint16_t batraw[BAT_CHANNELS];
 
-	millis_init();
-	serial_init();
-
-	printf("12V USV v0.3.2\r\n(c)2014 Thorin Hopkins\r\n");
-	printf("Built %s %s\r\n", __DATE__, __TIME__);
+int main(void)
+{
+	// Relays and output were already made safe in boot_protect()
+	bootmark(BOOT_MAIN);
+	boot_delay();	// Wait a bit to escape reset loops
 
-	#ifdef DEBUG
-		printf("Debug build!\r\n");
-	#endif
-	
-	printf("Configuration:\r\nBattery low warning threshold: %.2fV\r\nBattery very low warning threshold: %.2fV\r\nBattery discharged shut-off threshold: %.2fV\r\nRelay switching delay: %dms\r\nFan turn off delay: %luS\r\nReference voltage: %.2fV\r\nBattery 1 voltage divider ratio: %f\r\nBattery 2 voltage divider ratio: %f\r\n", BATLOWV, BATVLOWV, BATSHUTOFF, SWITCHDELAY, FANEXTPOWERON, (double)VREF, VDIV1, VDIV2);
+	out(BUZ);
+	crashlog_init();	// Enable watchdog, 8 seconds
 
 	in(OPTO);
 	in(MECHSW);
-	in(BAT1STAT);
-	in(BAT2STAT);
 	in(AUX);
 	
 	pullup(MECHSW);
-	pullup(BAT1STAT);
-	pullup(BAT2STAT);
+	bat_init();
 	
 	out(FANCTRL);
 	out(SOURCESEL1);
@@ -104,21 +113,33 @@ int main(void)
 	out(OUTCTRL);
 	out(CHARGESEL);
 
+	fan_init();
+
 	off(BUZ);	// Piezo input high -> off
 		
 	EICRA |= (1<<ISC00);	// INT0 trigger on level change
 	EIMSK |= (1<<INT0);		// Enable INT0
 	
-	ADMUX |= (1<<REFS0) | (1<<REFS1);	// Use external voltage reference
-	ADCSRA |= (1<<ADEN) | (1<<ADPS0) | (1<<ADPS1) | (1<<ADPS2);	// Enable ADC, Prescaler F_CPU/128
+	stats_init();
+	adc_init();
+	tele_init();
 	
 	TCCR2A |= (1<<WGM21);	// CTC Mode
 	TCCR2B |= (1<<CS21) | (1<<CS22);	// Prescaler F_CPU/256
 	OCR2A = 0x0C;
 	OCR2B = OCR2A - 1;
+
+	bootmark(BOOT_CONFIGURED);
+	boot_release();
+
+	millis_init();
+	serial_init();
 	
 	sei();	// Enable interrupts. Use atomic blocks from here on
 
+	adc_wait();	// Get a first set of battery voltages
+	batread();
+
 	switchStatus = !get(MECHSW);	// Go sure to call switch routine once at start
 	
 	if (get(OPTO))
@@ -135,11 +156,9 @@ int main(void)
 		powerStatus = false;
 		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
 		{
-			off(CHARGESEL);
-			_delay_ms(SWITCHDELAY);
-			off(SOURCESEL1);
-			_delay_ms(SWITCHDELAY);
-			off(SOURCESEL2);
+			relay_switch(RELAY_CHARGE, false);
+			relay_switch(RELAY_SOURCE1, false);
+			relay_switch(RELAY_SOURCE2, false);
 		}
 	}
 	
@@ -148,13 +167,18 @@ int main(void)
 	ledTimer = millis();
 	batLowTimer = millis();
 
-	printf("Init complete, entering main loop...\r\n");
+	boot_loop();
+	trace(TR_BOOT, crashlog_mcusr());
 
 	// Main loop
     while(1)
     {
 		wdt_reset();
+
+		bootmsg();	// Banner goes out in the background
+		trace_idle();
 		
+		TASK(TASK_SWITCH);
 		if (switchStatus != get(MECHSW))
 		{
 			switchStatus = get(MECHSW);
@@ -162,7 +186,8 @@ int main(void)
 			{
 				// Mech. Switch turned on
 				on(OUTCTRL);	// Turn on output
-				printf("Mech.Sw. turned on.\r\n");
+				trace(TR_SWITCH, 1);
+				printf_P(PSTR("Mech.Sw. turned on.\r\n"));
 				updateWait = true;
 				updateWaitTime = millis();
 			}
@@ -170,22 +195,28 @@ int main(void)
 			{
 				// Mech. Switch turned off
 				off(OUTCTRL);	// Turn off output
-				printf("Mech.Sw. turned off.\r\n");
+				trace(TR_SWITCH, 0);
+				printf_P(PSTR("Mech.Sw. turned off.\r\n"));
 				updateWait = true;
 				updateWaitTime = millis();
 			}
 		}
 	
+		TASK(TASK_POWER);
+		if (powerLost)
+		{
+			powerLost = false;
+			fprintf_P(&s_alarm, PSTR("Ext. power lost.\r\n"));
+		}
 		if (powerStatusChanged && ((millis() - powerStatusTime) >= ONDELAY) && get(OPTO))
 		{
 			// Power was turned on ONDELAY ago, react to it
 			ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
 			{
-				on(SOURCESEL1);
-				_delay_ms(SWITCHDELAY);
-				on(SOURCESEL2);
-				_delay_ms(SWITCHDELAY);
-				on(CHARGESEL);
+				trace(TR_POWER, 0);
+				relay_switch(RELAY_SOURCE1, true);
+				relay_switch(RELAY_SOURCE2, true);
+				relay_switch(RELAY_CHARGE, true);
 
 				powerStatusChanged = false;
 				powerStatus = true;
@@ -196,30 +227,26 @@ int main(void)
 			}
 		}
 		
-		if (powerStatus && (!get(BAT1STAT) || !get(BAT2STAT))) chargeStatus = true;	// Ignore charge status inputs if ext. power is off
-		else chargeStatus = false;
+		if (powerStatus && bat_chargemask()) chargeStatus = true;	// Ignore charge status inputs if ext. power is off
+		else if (!powerStatus || charge_state() != CHG_RESTART) chargeStatus = false;	// Charger is off on purpose during a restart
 
 		if (!get(MECHSW) || chargeStatus) fanOverride = true;	// Force fan on if mech. switch is on or batteries are charging
 		else fanOverride = false;
 
 		if (fanOverride && !fanStatus) fanrun(1000);
 
-		double bat1voltage, bat2voltage;
-		unsigned int bat1raw, bat2raw;
-		bat1raw = adcread(BAT1V);
-		bat2raw = adcread(BAT2V);
-		bat1voltage = ((double)bat1raw/1024*VREF)*VDIV1;
-		bat2voltage = ((double)bat2raw/1024*VREF)*VDIV2;
-		if (!get(CHARGESEL)) bat1voltage -= bat2voltage;
-		
-		bool static batLowVoltage = false;
-		bool static batVeryLowVoltage = false;
+		TASK(TASK_ADC);
+		adc_setpolicy(adcpolicy());
+		adc_update();
+		if (adc_ready()) batread();
 		
-		if (bat1voltage < BATLOWV || bat2voltage < BATLOWV) batLowVoltage = true;
-		else if (bat1voltage > BATLOWV+0.1 && bat2voltage > BATLOWV+0.1) batLowVoltage = false;
-		if (bat1voltage < BATVLOWV || bat2voltage < BATVLOWV) batVeryLowVoltage = true;
-		else if (bat1voltage > BATVLOWV+0.1 && bat2voltage > BATVLOWV+0.1) batVeryLowVoltage = false;
+		int16_t batLowest = bat_lowest(batmv);
+		if (batLowest < BATLOWV) batLowVoltage = true;
+		else if (batLowest > BATLOWV+BATHYST) batLowVoltage = false;
+		if (batLowest < BATVLOWV) batVeryLowVoltage = true;
+		else if (batLowest > BATVLOWV+BATHYST) batVeryLowVoltage = false;
 
+		TASK(TASK_LEDSTATE);
 		if (!updateWait || millis() - updateWaitTime >= UPDATEDELAY)
 		{
 			updateWait = false;
@@ -291,10 +318,11 @@ int main(void)
 			}
 		}
 
+		TASK(TASK_BATLOW);
 		if (millis() - batLowTimer >= 100)
 		{
 			batLowTimer = millis();
-			if (!switchStatus && !powerStatus && (bat1voltage < BATSHUTOFF || bat2voltage < BATSHUTOFF))
+			if (!switchStatus && !powerStatus && bat_lowest(batmv) < BATSHUTOFF)
 			{
 				batLowCounter++;
 			}
@@ -304,11 +332,18 @@ int main(void)
 		if (batLowCounter >= 20)
 		{
 			batLowCounter = 0;
+			TASK(TASK_PANIC);
+			trace(TR_PANIC, 0);
 			while (!get(MECHSW) && !get(OPTO))
 			{
 				// Panic! Wait for voltage to recover or system to shut down.
-				printf("Battery voltage critical!.\r\n");
-				printf("Battery 1: %fV - Battery 2: %fV\r\n", bat1voltage, bat2voltage);
+				fprintf_P(&s_alarm, PSTR("Battery voltage critical!.\r\n"));
+				char buf[FMTBUF_SIZE];
+				for (uint8_t i = 0; i < BAT_CHANNELS; i++)
+				{
+					fprintf_P(&s_alarm, i ? PSTR(" - Battery %u: %sV") : PSTR("Battery %u: %sV"), i + 1, fmt_mv(buf, batmv[i]));
+				}
+				fprintf_P(&s_alarm, PSTR("\r\n"));
 				off(OUTCTRL);
 				buz(true);
 				off(PWRLEDB);
@@ -324,11 +359,12 @@ int main(void)
 			}
 			
 			switchStatus = !get(MECHSW);
-			bat1voltage = ((double)adcread(BAT1V)/1024*VREF)*VDIV1;		// Update voltage to check if its high enough again
-			bat2voltage = ((double)adcread(BAT2V)/1024*VREF)*VDIV2;
+			adc_wait();		// Update voltage to check if its high enough again
+			batread();
 		}
 
 		// Handle LEDs and piezo buzzer
+		TASK(TASK_LEDS);
 		static ledstatus ledStatusAOld = OFF;
 		static ledstatus ledStatusBOld = OFF;
 		
@@ -337,7 +373,7 @@ int main(void)
 			ledStatusAOld = ledStatusA;
 			ledStatusBOld = ledStatusB;
 			ledcheck();
-			printf("Forcing led status change...\r\n");
+			printf_P(PSTR("Forcing led status change...\r\n"));
 		}
 		
 		if (millis() - ledTimer >= LEDFREQ)
@@ -346,66 +382,85 @@ int main(void)
 			ledcheck();
 		}
 		
-		if (millis() - statusTimer >= STATUSFREQ)
+		TASK(TASK_STATUS);
+		telemetry();
+		stats_update(get(OPTO), !powerStatus);
+		if (millis() - statusTimer >= tele_heartbeat())
 		{
 			millis_t now;
 			now = millis();
 			statusTimer = now;
-			int bat1percent, bat2percent;
-			bat1percent = (bat1voltage-BATSHUTOFF)/(BATMAX-BATSHUTOFF)*100;
-			bat2percent = (bat2voltage-BATSHUTOFF)/(BATMAX-BATSHUTOFF)*100;
-			if (bat1percent < 0) bat1percent = 0;
-			if (bat1percent > 100) bat1percent = 100;
-			if (bat2percent < 0) bat2percent = 0;
-			if (bat2percent > 100) bat2percent = 100;
-			printf("System status at %lu:%02lu:%02lu (since system start):\r\nMechSw: %u - Fan: %u - Charging: %u (%u, %u) - ExtPower: %u - LED Status: %u:%u\r\n", (now/1000/60/60), (now/1000/60) % 60, (now/1000) % 60, !get(MECHSW), fanStatus, chargeStatus, !(bool)get(BAT1STAT), !(bool)get(BAT2STAT), powerStatus, ledStatusA, ledStatusB);
-			printf("Battery 1: %.2fV (%u%% - Raw %u) - Battery 2: %.2fV (%u%% Raw: %u)\r\n", bat1voltage, bat1percent, bat1raw, bat2voltage, bat2percent, bat2raw);
+			printf_P(PSTR("System status at %lu:%02lu:%02lu (since system start):\r\nMechSw: %u - Fan: %u - Charging: %u ("), (now/1000/60/60), (now/1000/60) % 60, (now/1000) % 60, !get(MECHSW), fanStatus, chargeStatus);
+			for (uint8_t i = 0; i < BAT_CHANNELS; i++) printf_P(i ? PSTR(", %u") : PSTR("%u"), bat_charging(i));
+			printf_P(PSTR(") - ExtPower: %u - LED Status: %u:%u\r\n"), powerStatus, ledStatusA, ledStatusB);
+			char buf[FMTBUF_SIZE];
+			for (uint8_t i = 0; i < BAT_CHANNELS; i++)
+			{
+				printf_P(i ? PSTR(" - Battery %u: %sV (%u%% - Raw %u)") : PSTR("Battery %u: %sV (%u%% - Raw %u)"), i + 1, fmt_mv(buf, batmv[i]), bat_soc(batmv[i]), batraw[i]);
+			}
+			printf_P(PSTR("\r\n"));
+			printf_P(PSTR("ADC policy: %u - Stack headroom: %u bytes\r\n"), adc_policy(), stack_unused());
+			trace(TR_STATUS, 0);
 			if (fanStatus)
 			{
 				if (fanOverride)
 				{
-					printf("Fan override is on.\r\n");
+					printf_P(PSTR("Fan override is on.\r\n"));
 				}
 				else
 				{
-					printf("Fan running for another %lums.\r\n", (fanTurnOnTime + fanStatusTime) - now);
+					printf_P(PSTR("Fan running for another %lums.\r\n"), (fanTurnOnTime + fanStatusTime) - now);
 				}
+				printf_P(PSTR("Fan duty: %u/%u\r\n"), fan_duty(), FANDUTYMAX);
 			}
 		}
 		
+		TASK(TASK_HISTORY);
+		history_update(batmv, stateflags());
+		history_stream();
+
+		TASK(TASK_CHARGE);
 		static bool lastChargeStatus;
 		if (lastChargeStatus != chargeStatus)
 		{
 			lastChargeStatus = chargeStatus;
 			if (chargeStatus)
 			{
-				printf("Starting charge cycle\r\n");
-				chargeTimer = millis();
+				trace(TR_CHARGE, 1);
+				printf_P(PSTR("Starting charge cycle\r\n"));
 			}
 			else
 			{
-				printf("Stopping charge cycle\r\n");
-				chargeTimer = 0;
+				trace(TR_CHARGE, 0);
+				printf_P(PSTR("Stopping charge cycle\r\n"));
 			}
 		}
 		
-		if (chargeStatus && millis() - chargeTimer >= CHARGECYCLE)
+		uint8_t chargeAction = charge_update(powerStatus, bat_chargemask(), batmv);
+		if (chargeAction != CHG_NONE)
 		{
-			chargeTimer = millis();
-			printf("Cycling batteries to restart charge timer\r\n");
-			off(CHARGESEL);
-			_delay_ms(4500);
-			on(CHARGESEL);
-			_delay_ms(500);
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+			{
+				// INT0 owns CHARGESEL once ext. power is gone
+				if (powerStatus) relay_switch(RELAY_CHARGE, chargeAction == CHG_RESUME);
+			}
 		}
 
+		TASK(TASK_FAN);
 		fancheck();
 
+		TASK(TASK_COMMAND);
+		cmdcheck();
+
     }	// End of main loop
 }
 
 ISR(INT0_vect)
 {
+	uint8_t task = crashTask;
+	TASK(TASK_INT0);
+	trace(TR_INT0, get(OPTO) ? 1 : 0);
+
 	if (get(OPTO))
 	{
 		// External Power turned on
@@ -417,20 +472,30 @@ ISR(INT0_vect)
 		// External Power turned off
 		powerStatusChanged = false;
 		powerStatus = false;
-		off(CHARGESEL);
-		_delay_ms(SWITCHDELAY);
-		off(SOURCESEL1);
-		_delay_ms(SWITCHDELAY);
-		off(SOURCESEL2);
+		powerLost = true;
+		relay_switch(RELAY_CHARGE, false);
+		relay_switch(RELAY_SOURCE1, false);
+		relay_switch(RELAY_SOURCE2, false);
 		_delay_ms(ONDELAY);
 		fanStatusTime = 0;	// Stop fan from running on battery power
 		updateWait = true;
 		updateWaitTime = millis();
 	}
+
+	trace(TR_INT0END, 0);
+	TASK(task);
 }
 
 void ledcheck()
 {
+	static uint8_t lastStatus = 0xFF;
+	uint8_t status = ledStatusA << 4 | ledStatusB;
+	if (status != lastStatus)
+	{
+		lastStatus = status;
+		trace(TR_LEDS, status);
+	}
+
 	static uint8_t count = 0;
 	count++;
 	count = count & 0x03;
@@ -518,11 +583,11 @@ void ledcheck()
 
 void fanrun(unsigned long ms)
 {
-	// Turn fan on for a period of time
-	on(FANCTRL);
+	// Turn fan on for a period of time, duty is set by fancheck()
 	fanStatus = true;
 	fanTurnOnTime = millis();
-	printf("Running fan for %lums (or until override is off or power is disconnected).\r\n", ms);
+	trace(TR_FANRUN, ms / 60000 > 255 ? 255 : ms / 60000);
+	printf_P(PSTR("Running fan for %lums (or until override is off or power is disconnected).\r\n"), ms);
 	fanStatusTime = ms;
 }
 
@@ -533,27 +598,260 @@ void fancheck()
 	{
 		if (!fanOverride)
 		{
-			off(FANCTRL);
 			fanStatus = false;
-			printf("Turning fan off. Delay was %lu ms.\r\n", fanStatusTime);
+			trace(TR_FANSTOP, 0);
+			printf_P(PSTR("Turning fan off. Delay was %lu ms.\r\n"), fanStatusTime);
 			fanStatusTime = 0;
 
-			if (!powerStatus) printf("System shutting down...\r\n");
+			if (!powerStatus) fprintf_P(&s_alarm, PSTR("System shutting down...\r\n"));
+		}
+	}
+
+	fan_set(fanStatus ? fanduty() : 0);
+	fan_update();
+}
+
+uint8_t fanduty()
+{
+	// Pick fan duty from charge state, output state and time since ext. power turned on
+	millis_t elapsed = millis() - fanTurnOnTime;
+	uint8_t duty;
+
+	// Short runs (trailing override pulse) only need to keep some air moving
+	if (fanStatusTime < FANFULLTIME + 1000) duty = FANDUTYMIN;
+	// Timed run after ext. power turned on: full duty first, then taper off linearly to minimum
+	else if (elapsed < FANFULLTIME) duty = FANDUTYMAX;
+	else if (elapsed >= fanStatusTime) duty = FANDUTYMIN;
+	else duty = FANDUTYMIN + (uint8_t)((FANDUTYMAX - FANDUTYMIN) * ((fanStatusTime - elapsed) / 1000) / ((fanStatusTime - FANFULLTIME) / 1000));
+	if (!fanOverride) return duty;
+
+	// Override never runs the fan slower than a timed run that is still going
+	uint8_t level = chargeStatus ? FANDUTYCHARGE : powerStatus ? FANDUTYOUTPUT : FANDUTYBATTERY;
+	if (elapsed < fanStatusTime && duty > level) return duty;
+	return level;
+}
+
+void batread()
+{
+	// Convert latest ADC results to battery voltages
+	uint16_t results[BAT_CHANNELS];
+	adc_results(results);
+	for (uint8_t i = 0; i < BAT_CHANNELS; i++) batraw[i] = results[i] / ADC_SCALE;
+	bat_convert(results, batmv);
+}
+
+uint8_t adcpolicy()
+{
+	// Pick ADC sampling rate and depth from the operating state
+	if (updateWait || powerStatusChanged) return ADC_TRANSITION;
+	if (powerStatus) return chargeStatus ? ADC_CHARGING : ADC_IDLE;
+	if (bat_lowest(batmv) < BATLOWV+ADCMARGIN) return ADC_THRESHOLD;
+	return ADC_BATTERY;
+}
+
+void bootmsg()
+{
+	// Send one line of the boot banner per call, once the previous one has left the buffer
+	static uint8_t line = 0;
+	if (!s_txempty()) return;
+
+	char buf[FMTBUF_SIZE];
+	switch (line++)
+	{
+		case 0:
+			printf_P(PSTR("12V USV v%u.%u.%u\r\n(c)2014 Thorin Hopkins\r\n"), FWVERSION >> 8, (FWVERSION >> 4) & 0x0F, FWVERSION & 0x0F);
+			break;
+		case 1:
+			printf_P(PSTR("Built %S %S\r\n"), PSTR(__DATE__), PSTR(__TIME__));
+			#ifdef DEBUG
+				printf_P(PSTR("Debug build!\r\n"));
+			#endif
+			break;
+		case 2:
+			crashlog_report();
+			break;
+		case 3:
+			printf_P(PSTR("Configuration:\r\n"));
+			printf_P(PSTR("Battery: %u cells, %sV full\r\n"), BATTERY.cells, fmt_mv(buf, BATMAX));
+			printf_P(PSTR("Battery low warning threshold: %sV\r\n"), fmt_mv(buf, BATLOWV));
+			break;
+		case 4:
+			printf_P(PSTR("Battery very low warning threshold: %sV\r\n"), fmt_mv(buf, BATVLOWV));
+			printf_P(PSTR("Battery discharged shut-off threshold: %sV\r\n"), fmt_mv(buf, BATSHUTOFF));
+			break;
+		case 5:
+			printf_P(PSTR("Relay settle limit: %ums\r\nFan turn off delay: %lums\r\nFan full duty time: %lums\r\n"), RELAY_MAXSETTLE / 1000, FANEXTPOWERON, FANFULLTIME);
+			break;
+		case 6:
+			printf_P(PSTR("Reference voltage: %sV\r\n"), fmt_mv(buf, VREF*1000));
+			break;
+		default:
+			// One divider ratio per battery channel, then the rest
+			if (line - 8 < BAT_CHANNELS)
+			{
+				printf_P(PSTR("Battery %u voltage divider ratio: %s\r\n"), line - 7, fmt_fixed(buf, (uint32_t)BATCHANNELS[line - 8].range * 1000 / (uint16_t)(VREF*1000), 3));
+			}
+			else if (line - 8 == BAT_CHANNELS)
+			{
+				printf_P(PSTR("Serial: %lu baud\r\nInit complete, entering main loop...\r\n"), serial_getbaud());
+			}
+			else line = 9 + BAT_CHANNELS;	// Done
+			break;
+	}
+}
+
+uint8_t stateflags()
+{
+	uint8_t flags = 0;
+	if (powerStatus) flags |= STATE_POWER;
+	if (!switchStatus) flags |= STATE_OUTPUT;
+	if (fanStatus) flags |= STATE_FAN;
+	if (chargeStatus) flags |= STATE_CHARGE;
+	if (alarm) flags |= STATE_ALARM;
+	if (updateWait) flags |= STATE_UPDATEWAIT;
+	if (powerStatusChanged) flags |= STATE_POWERCHANGE;
+	if (get(CHARGESEL)) flags |= STATE_CHARGESEL;
+	return flags;
+}
+
+void telemetry()
+{
+	// Publish field groups that changed (see tele.h)
+	millis_t now = millis();
+	char buf[FMTBUF_SIZE];
+
+	int16_t pwr = stateflags() & (STATE_POWER | STATE_OUTPUT | STATE_ALARM | STATE_POWERCHANGE);
+	if (batLowVoltage) pwr |= 0x100;
+	if (batVeryLowVoltage) pwr |= 0x200;
+	if (tele_due(TELE_PWR, pwr, ledStatusA << 4 | ledStatusB))
+	{
+		static bool bootReported = false;
+		if (!bootReported)
+		{
+			bootReported = true;
+			boot_report();	// Goes with the first frame
+		}
+		printf_P(PSTR("PWR t=%lu ext=%u out=%u alarm=%u low=%u vlow=%u led=%u:%u\r\n"), now, powerStatus, !switchStatus, alarm, batLowVoltage, batVeryLowVoltage, ledStatusA, ledStatusB);
+	}
+
+	// Deadband on the lowest and highest battery, for two batteries that's both
+	int16_t lowest = batmv[0], highest = batmv[0];
+	for (uint8_t i = 1; i < BAT_CHANNELS; i++)
+	{
+		if (batmv[i] < lowest) lowest = batmv[i];
+		if (batmv[i] > highest) highest = batmv[i];
+	}
+	if (tele_due(TELE_BAT, lowest, highest))
+	{
+		printf_P(PSTR("BAT t=%lu"), now);
+		for (uint8_t i = 0; i < BAT_CHANNELS; i++) printf_P(PSTR(" v%u=%s"), i + 1, fmt_mv(buf, batmv[i]));
+		for (uint8_t i = 0; i < BAT_CHANNELS; i++) printf_P(PSTR(" raw%u=%u"), i + 1, batraw[i]);
+		printf_P(PSTR("\r\n"));
+	}
+
+	if (tele_due(TELE_FAN, fan_duty(), fanStatus))
+	{
+		printf_P(PSTR("FAN t=%lu on=%u duty=%u override=%u\r\n"), now, fanStatus, fan_duty(), fanOverride);
+	}
+
+	uint8_t stat = bat_chargemask();
+	if (tele_due(TELE_CHG, chargeStatus | charge_state() << 1 | stat << 3, charge_eta()))
+	{
+		printf_P(PSTR("CHG t=%lu on=%u"), now, chargeStatus);
+		for (uint8_t i = 0; i < BAT_CHANNELS; i++) printf_P(PSTR(" b%u=%u"), i + 1, (stat >> i) & 1);
+		printf_P(PSTR(" state=%u"), charge_state());
+		for (uint8_t i = 0; i < BAT_CHANNELS; i++) printf_P(PSTR(" r%u=%d"), i + 1, charge_rate(i));
+		printf_P(PSTR(" eta=%u restarts=%u\r\n"), charge_eta(), charge_restarts());
+	}
+}
+
+static_assert(BAT_CHANNELS <= MB_MAXCHANNELS, "Register map has room for MB_MAXCHANNELS batteries");
+
+void mb_snapshot(uint16_t *regs)
+{
+	// Register map for Modbus polling (see modbus.h)
+	millis_t now = millis();
+	memset(regs, 0, MB_REGS * sizeof(uint16_t));
+	regs[MB_REG_MAGIC] = MB_MAGIC;
+	regs[MB_REG_VERSION] = MB_MAPVERSION;
+	regs[MB_REG_FIRMWARE] = FWVERSION;
+	regs[MB_REG_CHANNELS] = BAT_CHANNELS;
+	regs[MB_REG_FLAGS] = stateflags();
+	regs[MB_REG_ALARMS] = batLowVoltage | batVeryLowVoltage << 1;
+	regs[MB_REG_UPTIME] = (now / 1000) >> 16;
+	regs[MB_REG_UPTIME+1] = now / 1000;
+	regs[MB_REG_CHARGESTATE] = charge_state();
+	regs[MB_REG_CHARGING] = bat_chargemask();
+	regs[MB_REG_CHARGEETA] = charge_eta();
+	regs[MB_REG_RESTARTS] = charge_restarts();
+	regs[MB_REG_FANDUTY] = fan_duty();
+	if (fanOverride) regs[MB_REG_FANREMAIN] = 0xFFFF;
+	else if (fanStatus) regs[MB_REG_FANREMAIN] = ((fanTurnOnTime + fanStatusTime) - now) / 1000;
+	regs[MB_REG_ADCPOLICY] = adc_policy();
+	regs[MB_REG_STACK] = stack_unused();
+	for (uint8_t i = 0; i < BAT_CHANNELS; i++)
+	{
+		regs[MB_REG_MV+i] = batmv[i];
+		regs[MB_REG_RAW+i] = batraw[i];
+		regs[MB_REG_SOC+i] = bat_soc(batmv[i]);
+		regs[MB_REG_RATE+i] = charge_rate(i);
+	}
+
+	statpower p;
+	stats_getpower(&p);
+	regs[MB_REG_OUTAGES] = p.outages;
+	regs[MB_REG_OUTAGETIME] = (p.outageTime / 1000) >> 16;
+	regs[MB_REG_OUTAGETIME+1] = p.outageTime / 1000;
+	regs[MB_REG_LONGEST] = (p.outageLongest / 1000) >> 16;
+	regs[MB_REG_LONGEST+1] = p.outageLongest / 1000;
+	regs[MB_REG_BATTERYTIME] = (p.batteryTime / 1000) >> 16;
+	regs[MB_REG_BATTERYTIME+1] = p.batteryTime / 1000;
+	for (uint8_t i = 0; i < LANES; i++)
+	{
+		lanestats st;
+		s_getlane(i, &st);
+		regs[MB_REG_DROPS] += st.drops;
+	}
+	for (uint8_t i = 0; i < RELAYS; i++)
+	{
+		for (uint8_t s = 0; s < 2; s++)
+		{
+			relaystats st;
+			relay_getstats(i, s, &st);
+			regs[MB_REG_RELAYOPS+i] += st.ops;
+			if (st.max > regs[MB_REG_RELAYMAX+i]) regs[MB_REG_RELAYMAX+i] = st.max;
+			regs[MB_REG_TIMEOUTS] += st.timeouts;
 		}
 	}
+	regs[MB_REG_HEARTBEAT] = tele_heartbeat();
+	regs[MB_REG_WINDOW] = stats_window();
+}
+
+uint8_t mb_write(uint16_t reg, uint16_t value, bool apply)
+{
+	// Writable configuration registers, slave address and idle time are handled in modbus.cpp
+	switch (reg)
+	{
+		case MB_REG_HEARTBEAT:
+			if (value < 100) return MB_EXVALUE;
+			if (apply) tele_setheartbeat(value);
+			return 0;
+		case MB_REG_WINDOW:
+			if (value < STATS_MINWINDOW) return MB_EXVALUE;
+			if (apply) stats_setwindow(value);
+			return 0;
+	}
+	return MB_EXADDRESS;
+}
+
+void mb_send(const uint8_t *frame, uint8_t len)
+{
+	s_putframe(frame, len);
 }
 
-unsigned long adcread(uint8_t ch)
+void mb_mute(bool mute)
 {
-	ADMUX = ch;
-	ADCSRA |= (1 << ADSC);
-	while (!(ADCSRA & (1 << ADIF)));
-	ADCSRA |= (1 << ADIF);
-	long value;
-	value = ADCL;
-	value += (ADCH<<8);
-
-	return (value);
+	s_setraw(mute);
 }
 
 void buz(bool state)
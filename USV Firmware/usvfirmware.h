@@ -12,7 +12,8 @@
 #define USVFIRMWARE_H_
 
 // -- Constants
-#define STATUSFREQ 1000
+#define FWVERSION 0x032		// Major << 8 | minor << 4 | patch
+#define STATUSFREQ 10000	// Default full status heartbeat, groups are published on change (see tele.h)
 #define LEDFREQ 500
 
 #define UPDATEDELAY 200	// Do not update LEDs and alarm after switching for X
@@ -21,16 +22,12 @@
 #define VDIV1 (25.5+4.9)/4.9	// Battery 1 voltage divider
 #define VDIV2 (25.5+12.4)/12.4	// Battery 2 voltage divider
 
-#define BATMAX 8.15
-#define BATLOWV 7.0
-#define BATVLOWV 6.9
-#define BATSHUTOFF 6.8
+// Battery thresholds come from the battery profile (see battery.h), charger supervision is in charge.h
 
-#define CHARGECYCLE 120*60000L	// Cycle batteries every X hours to reset charge timer
+#define ADCMARGIN 200	// Sample faster and deeper when within X mV of BATLOWV on bat. power
 
-// Switching delays
+// Switching delays (relay steps wait until the relay settled, see relay.h)
 #define ONDELAY 2000
-#define SWITCHDELAY 5
 
 // Fan delays
 #ifdef DEBUG
@@ -39,11 +36,47 @@
 	#define FANEXTPOWERON 180*60000L	// Run fan for 3 hours when ext. power turned on
 #endif
 
+// Fan duty levels (0-255, see fan.h for stall limit and soft start)
+#define FANDUTYCHARGE 153	// Batteries charging
+#define FANDUTYOUTPUT 128	// Output on, ext. power
+#define FANDUTYBATTERY 90	// Output on, bat. power
+#ifdef DEBUG
+	#define FANFULLTIME 10000L	// Full duty for 10 seconds after ext. power turned on in debug builds
+#else
+	#define FANFULLTIME 30*60000L	// Full duty for 30 minutes after ext. power turned on, then taper off
+#endif
+
 // -- Aliases
 #define LOFF 0
 #define LRED 1
 #define LGREEN 2
 
+// State flags, see stateflags()
+#define STATE_POWER 0x01		// Ext. power on
+#define STATE_OUTPUT 0x02		// Mech. switch on
+#define STATE_FAN 0x04
+#define STATE_CHARGE 0x08
+#define STATE_ALARM 0x10
+#define STATE_UPDATEWAIT 0x20
+#define STATE_POWERCHANGE 0x40	// Ext. power turned on, waiting for ONDELAY
+#define STATE_CHARGESEL 0x80
+
+// Task IDs for crash records, see crashlog.h
+#define TASK_INIT 0
+#define TASK_SWITCH 1
+#define TASK_POWER 2
+#define TASK_ADC 3
+#define TASK_LEDSTATE 4
+#define TASK_BATLOW 5
+#define TASK_PANIC 6
+#define TASK_LEDS 7
+#define TASK_STATUS 8
+#define TASK_CHARGE 9
+#define TASK_FAN 10
+#define TASK_INT0 11
+#define TASK_COMMAND 12
+#define TASK_HISTORY 13
+
 /*
 #define SPOWER 0
 #define SSWITCH 1
@@ -57,8 +90,13 @@ void pwrled(int col);
 void statled(int col);
 void fanrun(unsigned long ms);
 void fancheck();
+uint8_t fanduty();
 void ledcheck();
-unsigned long adcread(uint8_t ch);
+void batread();
+uint8_t adcpolicy();
 void buz(bool state);
+uint8_t stateflags();
+void bootmsg();
+void telemetry();
 
 #endif /* USVFIRMWARE_H_ */
\ No newline at end of file
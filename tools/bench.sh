@@ -0,0 +1,81 @@
+#!/bin/sh
+#
+# Project: 12V DC Uninterruptable Power Supply
+# File: bench.sh
+# Author: Thorin Hopkins (topy at untergrund dot net)
+# Copyright: (C) 2014 by Thorin Hopkins
+# License: GNU GPL v3 (see LICENSE.txt)
+# Web: https://github.com/Topy44/ups
+#
+# Cycle benchmark: builds the firmware with avr-gcc (Release settings plus
+# -DBENCH, which makes TASK() visible to the simulator), runs it under simavr
+# with a stimuli script and compares the cycle counts against a baseline.
+#
+# Usage: bench.sh [--save] [stimuli.stim]
+#
+# --save stores the results as the new baseline (tools/bench/baseline.txt).
+# Keys that got slower by more than BENCH_TOLERANCE percent (default 5) are
+# reported and make the script fail. Needs avr-gcc, a host compiler and
+# simavr (libsimavr, libelf).
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+FW="$ROOT/USV Firmware"
+BENCH="$ROOT/tools/bench"
+OUT=${BENCHDIR:-$BENCH/build}
+AVRCC=${AVRCC:-avr-gcc}
+AVRCXX=${AVRCXX:-avr-g++}
+HOSTCC=${HOSTCC:-cc}
+TOLERANCE=${BENCH_TOLERANCE:-5}
+BASELINE="$BENCH/baseline.txt"
+
+SAVE=0
+if [ "$1" = "--save" ]; then
+	SAVE=1
+	shift
+fi
+STIM=${1:-$BENCH/default.stim}
+
+COMMON="-mmcu=atmega328p -DF_CPU=16000000UL -DNDEBUG -DBENCH -funsigned-char -funsigned-bitfields -fpack-struct -fshort-enums -Wall"
+CFLAGS="$COMMON -Os -std=gnu99 -DARDUINO=155"
+CXXFLAGS="$COMMON -O3 -std=gnu++11"
+
+mkdir -p "$OUT" || exit 1
+
+# Same sources as the Atmel Studio project
+SOURCES=$(sed -n 's/.*<Compile Include="\([^"]*\.c\(pp\)\{0,1\}\)".*/\1/p' "$FW/usvfirmware.cppproj")
+OBJS=""
+for src in $SOURCES; do
+	obj="$OUT/${src%.*}.o"
+	case "$src" in
+		*.cpp) $AVRCXX $CXXFLAGS -c "$FW/$src" -o "$obj" || exit 1 ;;
+		*.c) $AVRCC $CFLAGS -c "$FW/$src" -o "$obj" || exit 1 ;;
+	esac
+	OBJS="$OBJS $obj"
+done
+$AVRCXX -mmcu=atmega328p -o "$OUT/usvfirmware.elf" $OBJS -lm || exit 1
+
+$HOSTCC -O2 -o "$OUT/avrbench" "$BENCH/avrbench.c" -lsimavr -lelf || exit 1
+"$OUT/avrbench" -o "$OUT/results.txt" -u "$OUT/uart.log" "$OUT/usvfirmware.elf" "$STIM" || exit 1
+
+if [ $SAVE -eq 1 ]; then
+	cp "$OUT/results.txt" "$BASELINE"
+	echo "Baseline saved to $BASELINE"
+	exit 0
+fi
+
+if [ ! -f "$BASELINE" ]; then
+	echo "No baseline yet, run $0 --save to store one"
+	exit 0
+fi
+
+echo "Compared to baseline (cycles, +slower/-faster):"
+awk -v tol="$TOLERANCE" '
+	NR == FNR { base[$1] = $2; next }
+	{
+		if (!($1 in base)) { printf "  %-28s %8d  (new)\n", $1, $2; next }
+		diff = base[$1] ? ($2 - base[$1]) * 100.0 / base[$1] : 0
+		flag = diff > tol ? "  REGRESSION" : ""
+		if (flag != "") bad++
+		printf "  %-28s %8d  %+6.1f%%%s\n", $1, $2, diff, flag
+	}
+	END { exit bad > 0 }' "$BASELINE" "$OUT/results.txt"
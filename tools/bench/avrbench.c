@@ -0,0 +1,322 @@
+/*
+ * Project: 12V DC Uninterruptable Power Supply
+ * File: avrbench.c
+ * Author: Thorin Hopkins (topy at untergrund dot net)
+ * Copyright: (C) 2014 by Thorin Hopkins
+ * License: GNU GPL v3 (see LICENSE.txt)
+ * Web: https://github.com/Topy44/ups
+ */
+
+// Cycle counting harness for the firmware under simavr. Runs a BENCH build of the firmware
+// image, applies pin, ADC and UART stimuli from a script and reports:
+//   - main loop cycles per pass (TASK_SWITCH to TASK_SWITCH), with and without ISR time
+//   - cycles per task section, from the TASK() markers written to GPIOR0
+//   - ISR entry-to-exit cycles and interrupt latency (flag set to vector entry) per vector
+// Results go to stdout and, with -o, to a "key value" file for tools/bench.sh to compare
+// against a baseline.
+//
+// Build: cc -O2 -o avrbench avrbench.c -lsimavr -lelf
+// Usage: avrbench [-o results.txt] [-u uart.log] firmware.elf stimuli.stim
+//
+// Script lines: <ms> pin <port><bit> 0|1, <ms> adc <channel> <mV at the pin>,
+// <ms> uart <text> (\n and \r are expanded), <ms> end. Lines must be sorted by time.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/sim_io.h>
+#include <simavr/sim_irq.h>
+#include <simavr/sim_interrupts.h>
+#include <simavr/avr_ioport.h>
+#include <simavr/avr_adc.h>
+#include <simavr/avr_uart.h>
+
+#define BENCH_FREQ 16000000UL
+#define BENCH_AREF 3000			// VREF in mV
+#define BENCH_GPIOR0 0x3E		// Data space address on the ATmega328P
+#define BENCH_TASKS 32
+#define BENCH_VECTORS 26
+#define BENCH_SCRIPT 256
+
+// ATmega328P vector names, index is the vector number
+static const char *vectorNames[BENCH_VECTORS] =
+{
+	"RESET", "INT0", "INT1", "PCINT0", "PCINT1", "PCINT2", "WDT", "TIMER2_COMPA",
+	"TIMER2_COMPB", "TIMER2_OVF", "TIMER1_CAPT", "TIMER1_COMPA", "TIMER1_COMPB", "TIMER1_OVF",
+	"TIMER0_COMPA", "TIMER0_COMPB", "TIMER0_OVF", "SPI_STC", "USART_RX", "USART_UDRE",
+	"USART_TX", "ADC", "EE_READY", "ANALOG_COMP", "TWI", "SPM_READY"
+};
+
+struct stat
+{
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+};
+
+struct event
+{
+	uint64_t cycle;
+	char cmd[8];
+	char arg1[8];
+	char arg2[64];
+};
+
+static avr_t *avr;
+static FILE *uartLog;
+
+static struct stat isrStats[BENCH_VECTORS];
+static struct stat latStats[BENCH_VECTORS];
+static uint64_t pendCycle[BENCH_VECTORS];
+static uint64_t entryCycle[BENCH_VECTORS];
+static uint64_t isrTotal;		// Cycles spent in ISRs so far
+
+static struct stat taskStats[BENCH_TASKS];
+static struct stat loopStats;
+static struct stat loopNetStats;
+static int lastTask = -1;
+static uint64_t lastTaskCycle;
+static uint64_t lastTaskIsr;
+static uint64_t loopCycle;
+static uint64_t loopIsr;
+
+static struct event script[BENCH_SCRIPT];
+static int scriptLen;
+
+static void statadd(struct stat *s, uint64_t v)
+{
+	if (!s->count || v < s->min) s->min = v;
+	if (v > s->max) s->max = v;
+	s->sum += v;
+	s->count++;
+}
+
+static void pending_cb(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	int v = (int)(intptr_t)param;
+	if (value && !pendCycle[v]) pendCycle[v] = avr->cycle;
+}
+
+static void running_cb(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	int v = (int)(intptr_t)param;
+	if (value)
+	{
+		entryCycle[v] = avr->cycle;
+		if (pendCycle[v]) statadd(&latStats[v], avr->cycle - pendCycle[v]);
+		pendCycle[v] = 0;
+	}
+	else if (entryCycle[v])
+	{
+		uint64_t cycles = avr->cycle - entryCycle[v];
+		statadd(&isrStats[v], cycles);
+		isrTotal += cycles;
+		entryCycle[v] = 0;
+	}
+}
+
+static void marker_cb(struct avr_t *avr, avr_io_addr_t addr, uint8_t v, void *param)
+{
+	// TASK() marker, the previous task section ends here
+	avr->data[addr] = v;
+	if (lastTask >= 0 && lastTask < BENCH_TASKS) statadd(&taskStats[lastTask], (avr->cycle - lastTaskCycle) - (isrTotal - lastTaskIsr));
+	lastTask = v;
+	lastTaskCycle = avr->cycle;
+	lastTaskIsr = isrTotal;
+
+	if (v == 1)	// TASK_SWITCH, first marker of a main loop pass
+	{
+		if (loopCycle)
+		{
+			statadd(&loopStats, avr->cycle - loopCycle);
+			statadd(&loopNetStats, (avr->cycle - loopCycle) - (isrTotal - loopIsr));
+		}
+		loopCycle = avr->cycle;
+		loopIsr = isrTotal;
+	}
+}
+
+static void uart_cb(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	if (uartLog) fputc(value, uartLog);
+}
+
+static void unescape(char *s)
+{
+	char *d = s;
+	for (; *s; s++)
+	{
+		if (s[0] == '\\' && s[1] == 'n') { *d++ = '\n'; s++; }
+		else if (s[0] == '\\' && s[1] == 'r') { *d++ = '\r'; s++; }
+		else *d++ = *s;
+	}
+	*d = '\0';
+}
+
+static int loadscript(const char *name)
+{
+	FILE *f = fopen(name, "r");
+	if (!f) return -1;
+	char line[160];
+	while (fgets(line, sizeof(line), f) && scriptLen < BENCH_SCRIPT)
+	{
+		char *hash = strchr(line, '#');
+		if (hash) *hash = '\0';
+		unsigned long ms;
+		struct event *e = &script[scriptLen];
+		memset(e, 0, sizeof(*e));
+		int n = sscanf(line, "%lu %7s %7s %63[^\n]", &ms, e->cmd, e->arg1, e->arg2);
+		if (n < 2) continue;
+		if (!strcmp(e->cmd, "uart"))
+		{
+			// Text is the rest of the line
+			sscanf(line, "%lu %7s %63[^\n]", &ms, e->cmd, e->arg2);
+			unescape(e->arg2);
+		}
+		e->cycle = (uint64_t)ms * (BENCH_FREQ / 1000);
+		scriptLen++;
+	}
+	fclose(f);
+	return 0;
+}
+
+static int apply(struct event *e)
+{
+	if (!strcmp(e->cmd, "end")) return 1;
+	if (!strcmp(e->cmd, "pin"))
+	{
+		avr_irq_t *irq = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ(e->arg1[0]), e->arg1[1] - '0');
+		avr_raise_irq(irq, atoi(e->arg2));
+	}
+	else if (!strcmp(e->cmd, "adc"))
+	{
+		avr_irq_t *irq = avr_io_getirq(avr, AVR_IOCTL_ADC_GETIRQ, ADC_IRQ_ADC0 + atoi(e->arg1));
+		avr_raise_irq(irq, atoi(e->arg2));
+	}
+	else if (!strcmp(e->cmd, "uart"))
+	{
+		avr_irq_t *irq = avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_INPUT);
+		for (char *c = e->arg2; *c; c++) avr_raise_irq(irq, (uint8_t)*c);
+	}
+	else fprintf(stderr, "Unknown script command %s\n", e->cmd);
+	return 0;
+}
+
+static void report(FILE *f, const char *key, const struct stat *s, int keys)
+{
+	if (!s->count) return;
+	if (keys) fprintf(f, "%s.avg %llu\n%s.max %llu\n", key, (unsigned long long)(s->sum / s->count), key, (unsigned long long)s->max);
+	else fprintf(f, "%-22s %8llu %8llu %8llu %8llu\n", key, (unsigned long long)s->count, (unsigned long long)s->min,
+		(unsigned long long)(s->sum / s->count), (unsigned long long)s->max);
+}
+
+static void results(FILE *f, int keys)
+{
+	char key[40];
+	if (!keys) fprintf(f, "%-22s %8s %8s %8s %8s\n", "Cycles", "Count", "Min", "Avg", "Max");
+	report(f, "loop", &loopStats, keys);
+	report(f, "loop.net", &loopNetStats, keys);
+	for (int i = 0; i < BENCH_TASKS; i++)
+	{
+		snprintf(key, sizeof(key), "task.%d", i);
+		report(f, key, &taskStats[i], keys);
+	}
+	for (int v = 0; v < BENCH_VECTORS; v++)
+	{
+		snprintf(key, sizeof(key), "isr.%s", vectorNames[v]);
+		report(f, key, &isrStats[v], keys);
+		snprintf(key, sizeof(key), "latency.%s", vectorNames[v]);
+		report(f, key, &latStats[v], keys);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	const char *out = NULL;
+	int opt = 1;
+	while (opt + 1 < argc && argv[opt][0] == '-')
+	{
+		if (!strcmp(argv[opt], "-o")) out = argv[opt+1];
+		else if (!strcmp(argv[opt], "-u")) uartLog = fopen(argv[opt+1], "w");
+		else break;
+		opt += 2;
+	}
+	if (argc - opt != 2)
+	{
+		fprintf(stderr, "Usage: avrbench [-o results.txt] [-u uart.log] firmware.elf stimuli.stim\n");
+		return 1;
+	}
+
+	elf_firmware_t fw;
+	memset(&fw, 0, sizeof(fw));
+	if (elf_read_firmware(argv[opt], &fw))
+	{
+		fprintf(stderr, "Can't load %s\n", argv[opt]);
+		return 1;
+	}
+	if (loadscript(argv[opt+1]))
+	{
+		fprintf(stderr, "Can't load %s\n", argv[opt+1]);
+		return 1;
+	}
+
+	avr = avr_make_mcu_by_name("atmega328p");
+	if (!avr) return 1;
+	avr_init(avr);
+	avr_load_firmware(avr, &fw);
+	avr->frequency = BENCH_FREQ;
+	avr->aref = BENCH_AREF;
+	avr->avcc = 5000;
+	avr->vcc = 5000;
+
+	// UART output goes to the log instead of the console
+	uint32_t flags = 0;
+	avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS('0'), &flags);
+	flags &= ~AVR_UART_FLAG_STDIO;
+	avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('0'), &flags);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUTPUT), uart_cb, NULL);
+
+	for (int v = 1; v < BENCH_VECTORS; v++)
+	{
+		avr_irq_t *irq = avr_get_interrupt_irq(avr, v);
+		if (!irq) continue;
+		avr_irq_register_notify(irq + AVR_INT_IRQ_PENDING, pending_cb, (void *)(intptr_t)v);
+		avr_irq_register_notify(irq + AVR_INT_IRQ_RUNNING, running_cb, (void *)(intptr_t)v);
+	}
+	avr_register_io_write(avr, BENCH_GPIOR0, marker_cb, NULL);
+
+	int next = 0;
+	int done = 0;
+	while (!done)
+	{
+		while (next < scriptLen && avr->cycle >= script[next].cycle)
+		{
+			if (apply(&script[next++])) done = 1;
+		}
+		if (next >= scriptLen) done = 1;	// Script without "end"
+
+		int state = avr_run(avr);
+		if (state == cpu_Done || state == cpu_Crashed)
+		{
+			fprintf(stderr, "Simulation stopped at cycle %llu (state %d)\n", (unsigned long long)avr->cycle, state);
+			return 1;
+		}
+	}
+
+	printf("Simulated %.3fs (%llu cycles)\n", avr->cycle / (double)BENCH_FREQ, (unsigned long long)avr->cycle);
+	results(stdout, 0);
+	if (out)
+	{
+		FILE *f = fopen(out, "w");
+		if (!f) return 1;
+		results(f, 1);
+		fclose(f);
+	}
+	if (uartLog) fclose(uartLog);
+	return 0;
+}
@@ -0,0 +1,716 @@
+/*
+ * Project: 12V DC Uninterruptable Power Supply
+ * File: fleetsim.cpp
+ * Author: Thorin Hopkins (topy at untergrund dot net)
+ * Copyright: (C) 2014 by Thorin Hopkins
+ * License: GNU GPL v3 (see LICENSE.txt)
+ * Web: https://github.com/Topy44/ups
+ */
+
+// Monte Carlo fleet simulator for threshold tuning. Runs thousands of independent virtual UPS
+// instances with the firmware's control logic (takeover delay, shut-off counter, charge supervision,
+// fan policy), a simple battery model and random outage schedules. Instance parameters (pack
+// aging, mismatch, temperature, load, outage rate) are drawn per instance. Instances are spread
+// over a work stealing thread pool. Results only depend on the seed, not on the thread count.
+//
+// Build: g++ -std=c++11 -O2 -pthread -I"../USV Firmware" fleetsim.cpp -o fleetsim
+// Usage: fleetsim [-n instances] [-d days] [-t threads] [-s seed] [--scale] [tuning options]
+//
+// Thresholds and delays default to the firmware's values (battery profile included, build with
+// -DBATPROFILE=... to simulate another pack) and can be overridden on the command line. The
+// number of batteries in series follows BATCHANNELS.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "usvfirmware.h"
+#include "battery.h"
+#include "charge.h"
+#include "fan.h"
+
+// -- Model constants
+#define SIM_CHUNK 16			// Instances per pool task
+#define SIM_STEPBAT 1000		// Step on battery power (ms)
+#define SIM_STEPEXT 60000		// Step on ext. power (ms)
+#define SIM_LOWTIME 2000		// Shut off after X ms below BATSHUTOFF (20 checks every 100ms)
+#define SIM_CAPACITY 2200.0		// Nominal pack capacity (mAh)
+#define SIM_RESISTANCE 40.0		// Nominal pack resistance (mOhm)
+#define SIM_CHARGECURRENT 1000.0	// Charger CC current (mA)
+#define SIM_EFFICIENCY 0.9		// Output converter
+#define SIM_QUIESCENT 0.3		// Controller, LEDs, relays (W)
+#define SIM_FANPOWER 1.5		// Fan power at full duty (W)
+#define SIM_RESERVE 0.05		// Capacity below the 0% SoC point before cells are damaged
+#define SIM_DEEPDROP 200		// Damage threshold below chemistry shut-off (mV per cell)
+#define SIM_HISTBINS 21			// Min. SoC histogram, 5% bins
+
+struct simconfig
+{
+	// Firmware tuning
+	int32_t shutoff;		// mV per battery
+	int64_t onDelay;
+	int64_t chargeWindow;
+	int64_t fanExtPowerOn;
+	int64_t fanFullTime;
+	uint8_t dutyCharge;
+	uint8_t dutyOutput;
+	uint8_t dutyBattery;
+	// Environment
+	int64_t chargerTimer;	// Charger safety timer
+	double outagesPerDay;	// Upper end of the per instance outage rate
+	double loadMax;			// W
+	double standby;			// Fraction of instances with the output switched off
+	// Run
+	uint32_t instances;
+	uint32_t days;
+	uint32_t threads;
+	uint64_t seed;
+};
+
+struct simstats
+{
+	uint64_t instances;
+	uint64_t simMs;
+	uint64_t outages;
+	uint64_t dropouts;			// Output shut off before ext. power came back
+	uint64_t dropoutMs;
+	uint64_t affected;			// Instances with at least one dropout
+	uint64_t deepDischarges;
+	uint64_t chargerTimeouts;
+	uint64_t chargerRestarts;
+	uint64_t relayOps;
+	uint64_t lowAlarms;
+	uint64_t fanMwh;
+	uint64_t steps;
+	uint64_t minSoc[SIM_HISTBINS];
+
+	void merge(const simstats &o)
+	{
+		instances += o.instances;
+		simMs += o.simMs;
+		outages += o.outages;
+		dropouts += o.dropouts;
+		dropoutMs += o.dropoutMs;
+		affected += o.affected;
+		deepDischarges += o.deepDischarges;
+		chargerTimeouts += o.chargerTimeouts;
+		chargerRestarts += o.chargerRestarts;
+		relayOps += o.relayOps;
+		lowAlarms += o.lowAlarms;
+		fanMwh += o.fanMwh;
+		steps += o.steps;
+		for (int i = 0; i < SIM_HISTBINS; i++) minSoc[i] += o.minSoc[i];
+	}
+};
+
+// -- Random numbers
+
+struct simrng
+{
+	uint64_t state;
+
+	uint64_t next()
+	{
+		// splitmix64
+		uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		return z ^ (z >> 31);
+	}
+
+	double uniform() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+	double uniform(double lo, double hi) { return lo + (hi - lo) * uniform(); }
+	double exponential(double mean) { return -mean * log(1.0 - uniform()); }
+};
+
+// -- Battery model
+
+struct simpack
+{
+	double capacity;	// mAh between 0% and 100% SoC
+	double charge;		// mAh, below 0 is the reserve
+	double resistance;	// mOhm
+	bool charging;
+	bool faulted;		// Charger safety timer expired
+
+	double soc() const { return charge / capacity; }
+
+	double ocv() const
+	{
+		// Resting pack voltage in mV from the profile's SoC table
+		double s = soc();
+		if (s >= 1.0) return BATMAX;
+		if (s >= 0.0)
+		{
+			double pos = s * (BAT_SOCPOINTS - 1);
+			int i = (int)pos;
+			double lo = BATTERY.chem.soc[i], hi = BATTERY.chem.soc[i+1];
+			return BATTERY.cells * (lo + (hi - lo) * (pos - i));
+		}
+		// Steep knee below 0%
+		return BATSHUTOFF - BATTERY.cells * SIM_DEEPDROP * (-s / SIM_RESERVE);
+	}
+
+	bool deep() const { return soc() < -SIM_RESERVE; }
+};
+
+// -- Instance
+
+class siminstance
+{
+public:
+	siminstance(const simconfig &cfg, uint32_t index) : cfg(cfg)
+	{
+		rng.state = cfg.seed ^ (0xD1B54A32D192ED03ULL * (index + 1));
+
+		double aging = rng.uniform(0.6, 1.0);
+		double temp = rng.uniform(-10.0, 45.0);
+		double cold = std::max(0.0, 20.0 - temp);
+		for (int i = 0; i < BAT_CHANNELS; i++)
+		{
+			simpack &p = pack[i];
+			p.capacity = SIM_CAPACITY * aging * rng.uniform(0.95, 1.05) * (1.0 - 0.01 * cold);
+			p.charge = p.capacity;
+			p.resistance = SIM_RESISTANCE * (1.0 + 2.0 * (1.0 - aging)) * (1.0 + 0.03 * cold) * rng.uniform(0.9, 1.1);
+			p.charging = false;
+			p.faulted = false;
+		}
+		load = rng.uniform(3.0, cfg.loadMax);
+		outageRate = rng.uniform(0.1, cfg.outagesPerDay);
+		outputOn = rng.uniform() >= cfg.standby;
+	}
+
+	void run(simstats &st)
+	{
+		int64_t end = (int64_t)cfg.days * 86400000LL;
+		scheduleOutage();
+		takeover();		// Starts on ext. power
+
+		while (now < end)
+		{
+			int64_t next = std::min(end, toggles.empty() ? end : toggles.front());
+			if (powerChanged) next = std::min(next, powerChangeTime + cfg.onDelay);
+			next = std::min(next, now + (powerStatus ? SIM_STEPEXT : SIM_STEPBAT));
+			advance(next - now);
+			now = next;
+			st.steps++;
+
+			while (!toggles.empty() && toggles.front() <= now)
+			{
+				toggles.pop_front();
+				setExt(!ext);
+			}
+			if (powerChanged && now - powerChangeTime >= cfg.onDelay && ext) takeover();
+		}
+
+		st.instances++;
+		st.simMs += end;
+		st.outages += outages;
+		st.dropouts += dropouts;
+		st.dropoutMs += dropoutMs;
+		st.affected += dropouts > 0;
+		st.deepDischarges += deepDischarges;
+		st.chargerTimeouts += chargerTimeouts;
+		st.chargerRestarts += chargerRestarts;
+		st.relayOps += relayOps;
+		st.lowAlarms += lowAlarms;
+		st.fanMwh += llround(fanWh * 1000.0);
+		int bin = (int)floor(std::max(0.0, minSoc) * (SIM_HISTBINS - 1) + 0.5);
+		st.minSoc[bin]++;
+	}
+
+private:
+	const simconfig &cfg;
+	simrng rng;
+	simpack pack[BAT_CHANNELS];
+	double load;
+	double outageRate;
+
+	int64_t now = 0;
+	bool ext = true;
+	std::deque<int64_t> toggles;	// Times the ext. power input flips
+
+	// Firmware state
+	bool outputOn;			// Mech. switch
+	bool panic = false;
+	bool powerStatus = false;
+	bool powerChanged = false;
+	int64_t powerChangeTime = 0;
+	bool relays = false;
+	bool chargeStatus = false;
+	int64_t chargeTimer = 0;		// Supervisor window start
+	double chargeWindowMv[BAT_CHANNELS];
+	uint8_t chargeRestarts = 0;
+	int64_t chargerElapsed = 0;
+	int64_t lowTime = 0;
+	bool batLow = false;
+	bool fanStatus = false;
+	int64_t fanTurnOnTime = 0;
+	int64_t fanStatusTime = 0;
+
+	// Outcomes
+	uint64_t outages = 0;
+	uint64_t dropouts = 0;
+	uint64_t dropoutMs = 0;
+	uint64_t deepDischarges = 0;
+	uint64_t chargerTimeouts = 0;
+	uint64_t chargerRestarts = 0;
+	uint64_t relayOps = 0;
+	uint64_t lowAlarms = 0;
+	bool deepNow = false;
+	double fanWh = 0;
+	double minSoc = 1.0;
+
+	void scheduleOutage()
+	{
+		// Next outage, plus bounces when power comes back
+		int64_t start = now + (int64_t)rng.exponential(86400000.0 / outageRate);
+		double kind = rng.uniform();
+		int64_t length;
+		if (kind < 0.4) length = (int64_t)rng.uniform(100, 3000);		// Glitch
+		else if (kind < 0.9) length = (int64_t)rng.exponential(5 * 60000.0);
+		else length = (int64_t)rng.exponential(120 * 60000.0);
+		toggles.push_back(start);
+		int64_t t = start + std::max<int64_t>(length, 50);
+		toggles.push_back(t);
+		if (rng.uniform() < 0.3)
+		{
+			int bounces = 1 + (int)(rng.uniform() * 3);
+			for (int i = 0; i < bounces; i++)
+			{
+				t += (int64_t)rng.uniform(500, 4000);
+				toggles.push_back(t);
+				t += (int64_t)rng.uniform(200, 1500);
+				toggles.push_back(t);
+			}
+		}
+	}
+
+	void setExt(bool on)
+	{
+		ext = on;
+		if (on)
+		{
+			// INT0, power on: wait ONDELAY before taking over
+			powerChanged = true;
+			powerChangeTime = now;
+			if (panic)
+			{
+				panic = false;
+			}
+			if (toggles.empty()) scheduleOutage();
+			return;
+		}
+
+		// INT0, power off: switch to batteries right away
+		outages++;
+		powerChanged = false;
+		powerStatus = false;
+		if (relays) relayOps += 3;
+		relays = false;
+		fanStatusTime = 0;
+		chargeStatus = false;
+		for (int i = 0; i < BAT_CHANNELS; i++) pack[i].charging = false;
+	}
+
+	void takeover()
+	{
+		if (!relays) relayOps += 3;
+		relays = true;
+		powerChanged = false;
+		powerStatus = true;
+		lowTime = 0;
+		restartCharger();
+		chargeTimer = now;
+		chargeRestarts = 0;
+		fanRun(cfg.fanExtPowerOn);
+	}
+
+	void restartCharger()
+	{
+		chargerElapsed = 0;		// Charger restarts with CHARGESEL
+		for (int i = 0; i < BAT_CHANNELS; i++)
+		{
+			pack[i].faulted = false;
+			pack[i].charging = pack[i].charge < pack[i].capacity;
+			chargeWindowMv[i] = pack[i].ocv();
+		}
+	}
+
+	void superviseCharge()
+	{
+		// Same checks as charge_update(): restart only if a pack below target stopped or stalled
+		if (now - chargeTimer < cfg.chargeWindow) return;
+		double rise = BATCHGRISE * (cfg.chargeWindow / 3600000.0);
+		bool stalled = false;
+		for (int i = 0; i < BAT_CHANNELS; i++)
+		{
+			double mv = pack[i].ocv();
+			if (mv < BATMAX - BATHYST && (!pack[i].charging || pack[i].faulted || mv - chargeWindowMv[i] < rise)) stalled = true;
+			chargeWindowMv[i] = mv;
+		}
+		chargeTimer = now;
+		if (stalled && chargeRestarts < CHG_MAXRESTARTS)
+		{
+			chargeRestarts++;
+			chargerRestarts++;
+			relayOps += 2;
+			restartCharger();
+		}
+	}
+
+	void fanRun(int64_t ms)
+	{
+		fanStatus = true;
+		fanTurnOnTime = now;
+		fanStatusTime = ms;
+	}
+
+	uint8_t fanDuty(bool fanOverride) const
+	{
+		// Same policy as fanduty() in the firmware
+		if (fanOverride)
+		{
+			if (chargeStatus) return cfg.dutyCharge;
+			if (powerStatus) return cfg.dutyOutput;
+			return cfg.dutyBattery;
+		}
+		if (fanStatusTime < cfg.fanFullTime + 1000) return FANDUTYMIN;
+		int64_t elapsed = now - fanTurnOnTime;
+		if (elapsed < cfg.fanFullTime) return FANDUTYMAX;
+		if (elapsed >= fanStatusTime) return FANDUTYMIN;
+		return FANDUTYMIN + (uint8_t)((FANDUTYMAX - FANDUTYMIN) * ((fanStatusTime - elapsed) / 1000) / ((fanStatusTime - cfg.fanFullTime) / 1000));
+	}
+
+	void advance(int64_t dt)
+	{
+		double hours = dt / 3600000.0;
+		bool output = outputOn && !panic;
+
+		// Fan
+		bool fanOverride = output || chargeStatus;
+		if (fanOverride && !fanStatus) fanRun(1000);
+		if (fanStatus && now - fanTurnOnTime >= fanStatusTime && !fanOverride) fanStatus = false;
+		double fanW = 0;
+		if (fanStatus)
+		{
+			double d = fanDuty(fanOverride) / 255.0;
+			fanW = SIM_FANPOWER * d * d * d;
+			fanWh += fanW * hours;
+		}
+
+		if (powerStatus)
+		{
+			// Charger, with safety timer and the firmware's charge supervision
+			bool charging = false;
+			for (int i = 0; i < BAT_CHANNELS; i++)
+			{
+				simpack &p = pack[i];
+				if (!p.charging || p.faulted) continue;
+				double s = p.soc();
+				double current = s < 0.9 ? SIM_CHARGECURRENT : SIM_CHARGECURRENT * std::max(0.05, (1.0 - s) * 10.0);
+				p.charge += current * hours * 0.98;
+				if (p.charge >= p.capacity)
+				{
+					p.charge = p.capacity;
+					p.charging = false;
+				}
+				charging = true;
+			}
+			chargerElapsed += dt;
+			if (charging && chargerElapsed >= cfg.chargerTimer)
+			{
+				for (int i = 0; i < BAT_CHANNELS; i++) if (pack[i].charging) pack[i].faulted = true;
+				chargerTimeouts++;
+				charging = false;
+			}
+
+			chargeStatus = charging;
+			superviseCharge();
+			return;
+		}
+
+		// On batteries
+		if (!ext || powerChanged)
+		{
+			if (!ext && outputOn && panic) dropoutMs += dt;	// Switched on, shut off by the firmware
+			double watts = SIM_QUIESCENT + fanW + (output ? load / SIM_EFFICIENCY : 0);
+			double ocv = 0;
+			for (int i = 0; i < BAT_CHANNELS; i++) ocv += pack[i].ocv();
+			double current = watts / (std::max(ocv, 1000.0) / 1000.0) * 1000.0;	// mA
+			int32_t lowest = INT32_MAX;
+			for (int i = 0; i < BAT_CHANNELS; i++)
+			{
+				simpack &p = pack[i];
+				p.charge = std::max(p.charge - current * hours, -2 * SIM_RESERVE * p.capacity);
+				minSoc = std::min(minSoc, p.soc());
+				lowest = std::min(lowest, (int32_t)(p.ocv() - current * p.resistance / 1000.0));
+			}
+
+			bool deep = false;
+			for (int i = 0; i < BAT_CHANNELS; i++) deep = deep || pack[i].deep();
+			if (deep && !deepNow) deepDischarges++;
+			deepNow = deep;
+
+			if (lowest < BATLOWV) { if (!batLow) lowAlarms++; batLow = true; }
+			else if (lowest > BATLOWV + BATHYST) batLow = false;
+
+			if (output && lowest < cfg.shutoff)
+			{
+				lowTime += dt;
+				if (lowTime >= SIM_LOWTIME)
+				{
+					// Panic, output off until ext. power returns
+					panic = true;
+					lowTime = 0;
+					if (!ext) dropouts++;
+				}
+			}
+			else lowTime = 0;
+		}
+	}
+};
+
+// -- Work stealing pool
+
+struct simrange
+{
+	uint32_t first;
+	uint32_t count;
+};
+
+struct simqueue
+{
+	std::mutex lock;
+	std::deque<simrange> tasks;
+};
+
+class simpool
+{
+public:
+	simpool(uint32_t threads) : queues(threads), stats(threads), steals(0) {}
+
+	void run(const simconfig &cfg)
+	{
+		// Contiguous blocks per worker, stealing evens out expensive instances
+		uint32_t n = queues.size();
+		uint32_t chunks = (cfg.instances + SIM_CHUNK - 1) / SIM_CHUNK;
+		for (uint32_t c = 0; c < chunks; c++)
+		{
+			simrange r = { c * SIM_CHUNK, std::min<uint32_t>(SIM_CHUNK, cfg.instances - c * SIM_CHUNK) };
+			queues[(uint64_t)c * n / chunks].tasks.push_back(r);
+		}
+
+		std::vector<std::thread> workers;
+		for (uint32_t i = 0; i < n; i++)
+		{
+			memset(&stats[i], 0, sizeof(simstats));
+			workers.push_back(std::thread(&simpool::worker, this, i, std::cref(cfg)));
+		}
+		for (auto &w : workers) w.join();
+	}
+
+	simstats total() const
+	{
+		simstats t;
+		memset(&t, 0, sizeof(t));
+		for (auto &s : stats) t.merge(s);
+		return t;
+	}
+
+	uint64_t stolen() const { return steals; }
+
+private:
+	std::vector<simqueue> queues;
+	std::vector<simstats> stats;
+	std::atomic<uint64_t> steals;
+
+	bool pop(uint32_t self, simrange &r)
+	{
+		// Own work from the back, steal from the front of the others
+		{
+			std::lock_guard<std::mutex> g(queues[self].lock);
+			if (!queues[self].tasks.empty())
+			{
+				r = queues[self].tasks.back();
+				queues[self].tasks.pop_back();
+				return true;
+			}
+		}
+		for (uint32_t i = 1; i < queues.size(); i++)
+		{
+			simqueue &q = queues[(self + i) % queues.size()];
+			std::lock_guard<std::mutex> g(q.lock);
+			if (!q.tasks.empty())
+			{
+				r = q.tasks.front();
+				q.tasks.pop_front();
+				steals++;
+				return true;
+			}
+		}
+		return false;	// No task creates new work, so empty queues mean done
+	}
+
+	void worker(uint32_t self, const simconfig &cfg)
+	{
+		simstats local;
+		memset(&local, 0, sizeof(local));
+		simrange r;
+		while (pop(self, r))
+		{
+			for (uint32_t i = r.first; i < r.first + r.count; i++)
+			{
+				siminstance inst(cfg, i);
+				inst.run(local);
+			}
+		}
+		stats[self] = local;
+	}
+};
+
+// -- Main
+
+static double simrun(const simconfig &cfg, simstats &st, uint64_t &steals)
+{
+	simpool pool(cfg.threads);
+	auto start = std::chrono::steady_clock::now();
+	pool.run(cfg);
+	double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	st = pool.total();
+	steals = pool.stolen();
+	return secs;
+}
+
+static void report(const simconfig &cfg, const simstats &st, double secs, uint64_t steals)
+{
+	double hours = st.simMs / 3600000.0;
+	double days = hours / 24.0;
+	printf("Profile: %u cells, shut-off %.2fV, low %.2fV\n", BATTERY.cells, cfg.shutoff / 1000.0, BATLOWV / 1000.0);
+	printf("Tuning: ondelay %lldms, charge window %lldmin, fan full %lldmin/%lldmin, duty %u/%u/%u\n",
+		(long long)cfg.onDelay, (long long)(cfg.chargeWindow / 60000), (long long)(cfg.fanFullTime / 60000), (long long)(cfg.fanExtPowerOn / 60000),
+		cfg.dutyCharge, cfg.dutyOutput, cfg.dutyBattery);
+	printf("Instances: %llu x %u days (%.0f instance-hours, %llu steps)\n", (unsigned long long)st.instances, cfg.days, hours, (unsigned long long)st.steps);
+	printf("Threads: %u, steals: %llu, wall: %.2fs, %.0f instance-hours/s\n", cfg.threads, (unsigned long long)steals, secs, hours / secs);
+	printf("Outages: %llu (%.2f per instance-day)\n", (unsigned long long)st.outages, st.outages / days);
+	printf("Missed holdovers: %llu (%.3f%% of outages, %.2f%% of instances), output off %.1fh\n", (unsigned long long)st.dropouts,
+		st.outages ? 100.0 * st.dropouts / st.outages : 0.0, 100.0 * st.affected / st.instances, st.dropoutMs / 3600000.0);
+	printf("Deep discharges: %llu\n", (unsigned long long)st.deepDischarges);
+	printf("Charger timeouts: %llu, supervisor restarts: %llu\n", (unsigned long long)st.chargerTimeouts, (unsigned long long)st.chargerRestarts);
+	printf("Low battery alarms: %llu\n", (unsigned long long)st.lowAlarms);
+	printf("Relay operations: %.2f per instance-day\n", st.relayOps / days);
+	printf("Fan energy: %.2fWh per instance-day\n", st.fanMwh / 1000.0 / days);
+	printf("Lowest SoC seen (instances):\n");
+	for (int i = 0; i < SIM_HISTBINS; i++)
+	{
+		if (st.minSoc[i]) printf("  %3d%%: %llu\n", i * 100 / (SIM_HISTBINS - 1), (unsigned long long)st.minSoc[i]);
+	}
+}
+
+static void usage()
+{
+	fprintf(stderr,
+		"Usage: fleetsim [options]\n"
+		"  -n N              Instances (1000)\n"
+		"  -d N              Simulated days per instance (30)\n"
+		"  -t N              Threads (all cores)\n"
+		"  -s N              Seed (1)\n"
+		"  --scale           Run with 1, 2, 4 .. threads and report speedup\n"
+		"  --shutoff MV      Shut-off threshold per battery (BATSHUTOFF)\n"
+		"  --ondelay MS      Takeover delay after power returns (ONDELAY)\n"
+		"  --window MIN      Charge supervision window (CHG_WINDOW)\n"
+		"  --fanrun MIN      Fan run time after power returns (FANEXTPOWERON)\n"
+		"  --fanfull MIN     Full duty time (FANFULLTIME)\n"
+		"  --duty C,O,B      Fan duty charging, output, battery (FANDUTY*)\n"
+		"  --chgtimer MIN    Charger safety timer (300)\n"
+		"  --outages N       Max. outages per day (4)\n"
+		"  --load W          Max. output load (15)\n"
+		"  --standby F       Fraction of instances with the output off (0.2)\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	simconfig cfg;
+	cfg.shutoff = BATSHUTOFF;
+	cfg.onDelay = ONDELAY;
+	cfg.chargeWindow = CHG_WINDOW;
+	cfg.fanExtPowerOn = FANEXTPOWERON;
+	cfg.fanFullTime = FANFULLTIME;
+	cfg.dutyCharge = FANDUTYCHARGE;
+	cfg.dutyOutput = FANDUTYOUTPUT;
+	cfg.dutyBattery = FANDUTYBATTERY;
+	cfg.chargerTimer = 300 * 60000LL;
+	cfg.outagesPerDay = 4;
+	cfg.loadMax = 15;
+	cfg.standby = 0.2;
+	cfg.instances = 1000;
+	cfg.days = 30;
+	cfg.threads = std::max(1u, std::thread::hardware_concurrency());
+	cfg.seed = 1;
+	bool scale = false;
+
+	for (int i = 1; i < argc; i++)
+	{
+		const char *a = argv[i];
+		const char *v = i + 1 < argc ? argv[i+1] : NULL;
+		if (!strcmp(a, "--scale")) { scale = true; continue; }
+		if (!v) usage();
+		i++;
+		if (!strcmp(a, "-n")) cfg.instances = strtoul(v, NULL, 10);
+		else if (!strcmp(a, "-d")) cfg.days = strtoul(v, NULL, 10);
+		else if (!strcmp(a, "-t")) cfg.threads = std::max(1ul, strtoul(v, NULL, 10));
+		else if (!strcmp(a, "-s")) cfg.seed = strtoull(v, NULL, 10);
+		else if (!strcmp(a, "--shutoff")) cfg.shutoff = strtol(v, NULL, 10);
+		else if (!strcmp(a, "--ondelay")) cfg.onDelay = strtoll(v, NULL, 10);
+		else if (!strcmp(a, "--window")) cfg.chargeWindow = strtoll(v, NULL, 10) * 60000;
+		else if (!strcmp(a, "--fanrun")) cfg.fanExtPowerOn = strtoll(v, NULL, 10) * 60000;
+		else if (!strcmp(a, "--fanfull")) cfg.fanFullTime = strtoll(v, NULL, 10) * 60000;
+		else if (!strcmp(a, "--chgtimer")) cfg.chargerTimer = strtoll(v, NULL, 10) * 60000;
+		else if (!strcmp(a, "--outages")) cfg.outagesPerDay = atof(v);
+		else if (!strcmp(a, "--load")) cfg.loadMax = atof(v);
+		else if (!strcmp(a, "--standby")) cfg.standby = atof(v);
+		else if (!strcmp(a, "--duty"))
+		{
+			unsigned c, o, b;
+			if (sscanf(v, "%u,%u,%u", &c, &o, &b) != 3) usage();
+			cfg.dutyCharge = c;
+			cfg.dutyOutput = o;
+			cfg.dutyBattery = b;
+		}
+		else usage();
+	}
+	if (!cfg.instances || !cfg.days || cfg.chargeWindow <= 0 || cfg.fanExtPowerOn <= cfg.fanFullTime) usage();
+
+	simstats st;
+	uint64_t steals;
+	if (!scale)
+	{
+		double secs = simrun(cfg, st, steals);
+		report(cfg, st, secs, steals);
+		return 0;
+	}
+
+	// Scaling run, same fleet at each thread count
+	uint32_t maxThreads = cfg.threads;
+	double base = 0;
+	printf("Threads  Wall(s)  Inst-h/s  Speedup  Steals\n");
+	for (uint32_t t = 1; t <= maxThreads; t = (t * 2 > maxThreads && t != maxThreads) ? maxThreads : t * 2)
+	{
+		cfg.threads = t;
+		double secs = simrun(cfg, st, steals);
+		if (t == 1) base = secs;
+		printf("%7u  %7.2f  %8.0f  %7.2f  %6llu\n", t, secs, st.simMs / 3600000.0 / secs, base / secs, (unsigned long long)steals);
+	}
+	return 0;
+}
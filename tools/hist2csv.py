@@ -0,0 +1,117 @@
+#!/usr/bin/env python3
+#
+# Project: 12V DC Uninterruptable Power Supply
+# File: hist2csv.py
+# Author: Thorin Hopkins (topy at untergrund dot net)
+# Copyright: (C) 2014 by Thorin Hopkins
+# License: GNU GPL v3 (see LICENSE.txt)
+# Web: https://github.com/Topy44/ups
+#
+# Decode "hist sec" / "hist min" / "hist day" dumps from a serial capture to CSV
+# (time in seconds since system start, battery voltages in V, state flags).
+#
+# Usage: hist2csv.py capture.txt > history.csv
+#
+# Block format is described in history.h. Sample indices are 16 bit and
+# unwrapped backwards from the sample count in the dump header. Dumps
+# without a channel count in the header are from two battery firmware.
+
+import argparse
+import re
+import sys
+
+HEADER = re.compile(r"HIST (\d+) (\d+) (\d+) (\d+) (\d+)(?: (\d+))?")
+BLOCK = re.compile(r"HB ([0-9A-F ]+)")
+
+
+def varint(data, pos):
+    value = 0
+    shift = 0
+    while True:
+        b = data[pos]
+        pos += 1
+        value |= (b & 0x7F) << shift
+        shift += 7
+        if not b & 0x80:
+            break
+    return (value >> 1) ^ -(value & 1), pos
+
+
+def decode_block(start, v, flags, data):
+    # Yields (sample index, values, flags)
+    n = len(v)
+    small = (2 + 3 * n + 7) // 8
+    idx = start
+    yield idx, v, flags
+    pos = 0
+    while pos < len(data):
+        tag = data[pos]
+        if tag < 0x80:
+            pos += 1
+            for _ in range(tag):
+                idx += 1
+                yield idx, v, flags
+        elif tag < 0xC0:
+            # "10", then 3 bits per channel, MSB first
+            bits = int.from_bytes(data[pos:pos + small], "big")
+            pos += small
+            shift = small * 8 - 2
+            v = list(v)
+            for i in range(n):
+                shift -= 3
+                v[i] += ((bits >> shift) & 0x07) - 4
+            idx += 1
+            yield idx, v, flags
+        else:
+            pos += 1
+            v = list(v)
+            for i in range(n):
+                d, pos = varint(data, pos)
+                v[i] += d
+            if tag & 0x02:
+                flags = data[pos]
+                pos += 1
+            idx += 1
+            yield idx, v, flags
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Convert UPS history dumps to CSV")
+    parser.add_argument("capture", nargs="+")
+    args = parser.parse_args()
+
+    out = sys.stdout
+    columns = None
+    for name in args.capture:
+        header = None
+        with open(name, errors="replace") as f:
+            for line in f:
+                m = HEADER.search(line)
+                if m:
+                    header = [int(x) for x in m.groups(2)]
+                    if columns is None:
+                        columns = header[5]
+                        out.write("time,%s,flags\n" % ",".join("bat%u" % (i + 1) for i in range(columns)))
+                    continue
+                m = BLOCK.search(line)
+                if not m or header is None:
+                    continue
+                _, interval, unit, samples, now, n = header
+                fields = m.group(1).split()
+                if len(fields) < n + 2:
+                    continue
+                start = int(fields[0])
+                v = [int(x) for x in fields[1:n + 1]]
+                flags = int(fields[n + 1], 16)
+                data = bytes.fromhex(fields[n + 2]) if len(fields) > n + 2 else b""
+                for idx, vals, fl in decode_block(start, v, flags, data):
+                    age = (samples - 1 - idx) & 0xFFFF
+                    if age > 0x8000:
+                        age -= 0x10000  # Appended after the header
+                    t = now / 1000.0 - age * interval
+                    volts = ",".join("%.2f" % (x * unit / 1000.0) for x in vals[:columns])
+                    out.write("%.0f,%s,%02X\n" % (t, volts, fl))
+
+
+if __name__ == "__main__":
+    main()
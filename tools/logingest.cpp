@@ -0,0 +1,918 @@
+/*
+ * Project: 12V DC Uninterruptable Power Supply
+ * File: logingest.cpp
+ * Author: Thorin Hopkins (topy at untergrund dot net)
+ * Copyright: (C) 2014 by Thorin Hopkins
+ * License: GNU GPL v3 (see LICENSE.txt)
+ * Web: https://github.com/Topy44/ups
+ */
+
+// Ingests serial captures of the firmware's text output into a columnar binary time series and
+// runs range queries on it. Capture files are memory mapped and split into chunks at line
+// boundaries, chunks are scanned in parallel by a hand written scanner that works on the mapping
+// directly (no allocation per line). Understands the status block ("System status at H:MM:SS",
+// "MechSw: ..", "Battery 1: x.xxV (n% - Raw r) ..") of all firmware versions, the telemetry lines
+// (PWR/BAT/FAN/CHG/STAT t=..) and the event messages (mech. switch, fan, charger, power loss, boot, shutdown).
+//
+// Time is reconstructed from the uptime in status and telemetry lines. A reboot (boot banner or
+// uptime going backwards) starts a new session, sessions are laid end to end into one monotonic
+// log time in ms. Lines without a timestamp take the time of the last one seen. Captures given
+// on the command line are treated as one continuous log in that order.
+//
+// Build: g++ -std=c++11 -O2 -pthread logingest.cpp -o logingest
+// Usage: logingest ingest [-t threads] -o out.ulg capture.txt [more captures...]
+//        logingest query file.ulg [--from S] [--to S] [--events] [--summary]
+//
+// Output file (little endian, every section 8 byte aligned): ulgheader, then the sections in
+// ulgsection order. Sample times are stored as 32 bit offsets from a per block base, blocks hold
+// up to ULG_BLOCK rows. Queries map the file and binary search the block index.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+// -- Constants
+#define ULG_MAGIC "ULG1"
+#define ULG_BLOCK 4096			// Max. rows per time block
+#define ING_CHUNK (8UL << 20)	// Target chunk size (bytes)
+#define ING_SLACK 2000			// Uptime may go back this much (ms) without a reboot, status times are truncated to seconds
+
+// Row flags
+#define FL_EXT 0x01			// Ext. power
+#define FL_OUT 0x02			// Output on (mech. switch)
+#define FL_FAN 0x04
+#define FL_CHG 0x08			// Charging
+#define FL_LOW 0x10			// Low battery warning
+#define FL_VLOW 0x20		// Very low battery warning
+
+// Events
+enum
+{
+	EV_BOOT,
+	EV_MECHON,
+	EV_MECHOFF,
+	EV_FANRUN,			// arg: run time (ms)
+	EV_FANOFF,			// arg: delay (ms)
+	EV_CHGSTART,
+	EV_CHGSTOP,
+	EV_CHGRESTART,
+	EV_CHGDONE,
+	EV_CRITICAL,
+	EV_SHUTDOWN,
+	EV_POWERLOST,
+	EV_COUNT
+};
+
+static const char *eventNames[EV_COUNT] = { "boot", "mech on", "mech off", "fan run", "fan off", "charge start", "charge stop",
+	"charger restart", "charge complete", "battery critical", "shutdown", "power lost" };
+
+// -- File format
+
+enum ulgsection
+{
+	SEC_BLOCKBASE,		// int64, log time of the block's first row
+	SEC_BLOCKROW,		// uint64, first row of the block
+	SEC_SESSIONSTART,	// int64, log time the session starts at
+	SEC_SESSIONROW,		// uint64, first row of the session
+	SEC_EVENTTIME,		// int64
+	SEC_TIME,			// uint32, offset from the block base
+	SEC_EVENTARG,		// uint32
+	SEC_RAW1,			// uint16, ADC result
+	SEC_RAW2,
+	SEC_MV1,			// int16, voltage as printed
+	SEC_MV2,
+	SEC_FLAGS,			// uint8, FL_*
+	SEC_EVENTTYPE,		// uint8, EV_*
+	SEC_COUNT
+};
+
+struct ulgheader
+{
+	char magic[4];
+	uint32_t sections;
+	uint64_t rows;
+	uint64_t events;
+	uint64_t blocks;
+	uint64_t sessions;
+	uint64_t offset[SEC_COUNT];
+};
+
+// -- Scanner
+
+struct ingrow
+{
+	int64_t time;		// Chunk local, -1 before the chunk's first timestamp
+	uint16_t raw1;
+	uint16_t raw2;
+	int16_t mv1;
+	int16_t mv2;
+	uint8_t flags;
+	uint8_t known;		// Flags set within the chunk so far, the rest come from the previous chunk
+};
+
+struct ingevent
+{
+	int64_t time;
+	uint32_t arg;
+	uint8_t type;
+};
+
+struct ingsession
+{
+	int64_t time;
+	uint64_t row;
+};
+
+struct ingchunk
+{
+	const char *begin;
+	const char *end;
+
+	// Scan results
+	std::vector<ingrow> rows;
+	std::vector<ingevent> events;
+	std::vector<ingsession> sessions;	// Reboots after the first timestamp
+	bool timed;
+	bool resetFirst;		// Boot banner before the first timestamp
+	bool pending;			// Boot banner after the last timestamp
+	uint32_t firstUptime;
+	uint64_t firstRow;		// Rows before it belong to the previous chunk's session
+	uint32_t lastUptime;
+	int64_t localOff;		// Uptime of the sessions that ended within the chunk
+	uint8_t flags;
+	uint8_t known;
+
+	// Placement, filled in after the scan
+	uint64_t row0;
+	uint64_t event0;
+	int64_t base;			// Log time of local time 0
+	int64_t untimed;		// Log time of everything before the first timestamp
+	uint8_t inFlags;		// Flags at chunk start
+};
+
+struct cursor
+{
+	const char *p;
+	const char *end;
+
+	bool lit(const char *s)
+	{
+		// Match a literal and step over it
+		const char *q = p;
+		while (*s)
+		{
+			if (q == end || *q != *s) return false;
+			q++;
+			s++;
+		}
+		p = q;
+		return true;
+	}
+
+	bool num(uint32_t &v)
+	{
+		const char *q = p;
+		uint32_t r = 0;
+		while (q < end && *q >= '0' && *q <= '9') r = r * 10 + (*q++ - '0');
+		if (q == p) return false;
+		p = q;
+		v = r;
+		return true;
+	}
+
+	bool flag(uint8_t &flags, uint8_t &known, uint8_t bit)
+	{
+		// "0" or "1"
+		uint32_t v;
+		if (!num(v)) return false;
+		flags = v ? flags | bit : flags & ~bit;
+		known |= bit;
+		return true;
+	}
+
+	bool volts(int16_t &mv)
+	{
+		// Fixed point volts ("7.02", "-0.05", "7.016357") to mV, rounded
+		bool neg = lit("-");
+		uint32_t whole;
+		if (!num(whole)) return false;
+		int32_t r = whole * 1000;
+		if (lit("."))
+		{
+			int32_t scale = 100;
+			const char *q = p;
+			for (; p < end && *p >= '0' && *p <= '9'; p++)
+			{
+				if (p - q < 3) r += (*p - '0') * scale;
+				else if (p - q == 3 && *p >= '5') r++;		// Round on the fourth decimal
+				scale /= 10;
+			}
+		}
+		mv = neg ? -r : r;
+		return true;
+	}
+
+	bool skip(const char *s)
+	{
+		// Step past the next occurrence of s
+		size_t n = strlen(s);
+		for (const char *q = p; q + n <= end; q++)
+		{
+			if (*q == *s && !memcmp(q, s, n))
+			{
+				p = q + n;
+				return true;
+			}
+		}
+		return false;
+	}
+};
+
+class scanner
+{
+public:
+	scanner(ingchunk &c) : c(c) {}
+
+	void run()
+	{
+		c.rows.reserve((c.end - c.begin) / 256);
+		c.events.reserve((c.end - c.begin) / 2048);
+		c.timed = c.resetFirst = c.pending = false;
+		c.localOff = 0;
+		c.flags = c.known = 0;
+		const char *p = c.begin;
+		while (p < c.end)
+		{
+			const char *nl = (const char *)memchr(p, '\n', c.end - p);
+			const char *e = nl ? nl : c.end;
+			cursor l = { p, e > p && e[-1] == '\r' ? e - 1 : e };
+			line(l);
+			p = e + 1;
+		}
+		c.pending = pending;
+	}
+
+private:
+	ingchunk &c;
+	bool pending = false;
+
+	int64_t now() const
+	{
+		return c.timed ? c.localOff + c.lastUptime : -1;
+	}
+
+	void stamp(uint32_t up)
+	{
+		if (!c.timed)
+		{
+			c.timed = true;
+			c.resetFirst = pending;
+			c.firstUptime = c.lastUptime = up;
+			c.firstRow = c.rows.size();
+		}
+		else if (pending || up + ING_SLACK < c.lastUptime)
+		{
+			// Rebooted
+			c.localOff += c.lastUptime;
+			c.lastUptime = up;
+			c.sessions.push_back({ c.localOff, c.rows.size() });
+		}
+		else if (up > c.lastUptime) c.lastUptime = up;
+		pending = false;
+	}
+
+	void event(uint8_t type, uint32_t arg = 0)
+	{
+		c.events.push_back({ now(), arg, type });
+	}
+
+	void sample(uint16_t raw1, uint16_t raw2, int16_t mv1, int16_t mv2)
+	{
+		c.rows.push_back({ now(), raw1, raw2, mv1, mv2, c.flags, c.known });
+	}
+
+	void setflag(uint8_t bit, bool on)
+	{
+		c.flags = on ? c.flags | bit : c.flags & ~bit;
+		c.known |= bit;
+	}
+
+	void line(cursor &l)
+	{
+		uint32_t v;
+		if (l.p == l.end) return;
+		switch (*l.p)
+		{
+			case 'S':
+				if (l.lit("System status at "))
+				{
+					uint32_t h, m, s;
+					if (l.num(h) && l.lit(":") && l.num(m) && l.lit(":") && l.num(s)) stamp(((h * 60 + m) * 60 + s) * 1000);
+				}
+				else if (l.lit("Starting charge cycle"))
+				{
+					setflag(FL_CHG, true);
+					event(EV_CHGSTART);
+				}
+				else if (l.lit("Stopping charge cycle"))
+				{
+					setflag(FL_CHG, false);
+					event(EV_CHGSTOP);
+				}
+				else if (l.lit("System shutting down")) event(EV_SHUTDOWN);
+				else telemetry(l);
+				return;
+
+			case 'M':
+				if (l.lit("MechSw: "))
+				{
+					l.flag(c.flags, c.known, FL_OUT) && l.lit(" - Fan: ") && l.flag(c.flags, c.known, FL_FAN) && l.lit(" - Charging: ") &&
+						l.flag(c.flags, c.known, FL_CHG) && l.skip(" - ExtPower: ") && l.flag(c.flags, c.known, FL_EXT);
+				}
+				else if (l.lit("Mech.Sw. turned "))
+				{
+					bool on = l.lit("on");
+					setflag(FL_OUT, on);
+					event(on ? EV_MECHON : EV_MECHOFF);
+				}
+				return;
+
+			case 'B':
+				if (l.lit("Battery 1: "))
+				{
+					// Status sample, the critical message has no raw values. Older firmware wrote "Raw:"
+					// for battery 2, batteries past the second aren't stored
+					int16_t mv1, mv2;
+					uint32_t raw1, raw2;
+					if (l.volts(mv1) && l.skip("Raw ") && l.num(raw1) && l.skip("Battery 2: ") && l.volts(mv2) && l.skip("Raw") &&
+						(l.lit(":") || true) && l.lit(" ") && l.num(raw2))
+					{
+						sample(raw1, raw2, mv1, mv2);
+					}
+				}
+				else if (l.lit("Battery voltage critical")) event(EV_CRITICAL);
+				else if (l.lit("BAT t="))
+				{
+					int16_t mv1, mv2;
+					uint32_t raw1, raw2;
+					if (!l.num(v)) return;
+					stamp(v);
+					if (l.lit(" v1=") && l.volts(mv1) && l.lit(" v2=") && l.volts(mv2) && l.lit(" raw1=") && l.num(raw1) && l.lit(" raw2=") && l.num(raw2))
+					{
+						sample(raw1, raw2, mv1, mv2);
+					}
+				}
+				return;
+
+			case 'P':
+				if (l.lit("PWR t="))
+				{
+					if (!l.num(v)) return;
+					stamp(v);
+					l.lit(" ext=") && l.flag(c.flags, c.known, FL_EXT) && l.lit(" out=") && l.flag(c.flags, c.known, FL_OUT) &&
+						l.skip(" low=") && l.flag(c.flags, c.known, FL_LOW) && l.lit(" vlow=") && l.flag(c.flags, c.known, FL_VLOW);
+				}
+				return;
+
+			case 'F':
+				if (l.lit("FAN t="))
+				{
+					if (!l.num(v)) return;
+					stamp(v);
+					l.lit(" on=") && l.flag(c.flags, c.known, FL_FAN);
+				}
+				return;
+
+			case 'C':
+				if (l.lit("CHG t="))
+				{
+					if (!l.num(v)) return;
+					stamp(v);
+					l.lit(" on=") && l.flag(c.flags, c.known, FL_CHG);
+				}
+				else if (l.lit("Cycling batteries") || l.lit("Charge stalled")) event(EV_CHGRESTART);
+				else if (l.lit("Charge complete")) event(EV_CHGDONE);
+				return;
+
+			case 'E':
+				if (l.lit("Ext. power lost")) event(EV_POWERLOST);
+				return;
+
+			case 'R':
+				if (l.lit("Running fan for ") && l.num(v))
+				{
+					setflag(FL_FAN, true);
+					event(EV_FANRUN, v);
+				}
+				return;
+
+			case 'T':
+				if (l.lit("Turning fan off. Delay was ") && l.num(v))
+				{
+					setflag(FL_FAN, false);
+					event(EV_FANOFF, v);
+				}
+				return;
+
+			case '1':
+				if (l.lit("12V USV v"))
+				{
+					pending = true;
+					if (!c.timed) c.resetFirst = true;
+					event(EV_BOOT);
+				}
+				return;
+		}
+	}
+
+	void telemetry(cursor &l)
+	{
+		// Other telemetry lines ("STAT t=..") only carry time
+		uint32_t v;
+		if (l.end - l.p > 4 && l.p[0] >= 'A' && l.p[0] <= 'Z' && (l.skip(" t=") && l.num(v))) stamp(v);
+	}
+};
+
+// -- Ingest
+
+struct mapping
+{
+	const char *data;
+	size_t size;
+};
+
+static bool mapfile(const char *name, mapping &m)
+{
+	int fd = open(name, O_RDONLY);
+	if (fd < 0)
+	{
+		perror(name);
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+	{
+		perror(name);
+		close(fd);
+		return false;
+	}
+	m.size = st.st_size;
+	m.data = NULL;
+	if (m.size)
+	{
+		void *p = mmap(NULL, m.size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED)
+		{
+			perror(name);
+			close(fd);
+			return false;
+		}
+		madvise(p, m.size, MADV_SEQUENTIAL);
+		m.data = (const char *)p;
+	}
+	close(fd);
+	return true;
+}
+
+static void split(const mapping &m, std::vector<ingchunk> &chunks)
+{
+	// Chunks end after a newline, the last one at the end of the file
+	const char *p = m.data;
+	const char *end = m.data + m.size;
+	while (p < end)
+	{
+		const char *e = p + std::min<size_t>(ING_CHUNK, end - p);
+		if (e < end)
+		{
+			const char *nl = (const char *)memchr(e, '\n', end - e);
+			e = nl ? nl + 1 : end;
+		}
+		chunks.emplace_back();
+		chunks.back().begin = p;
+		chunks.back().end = e;
+		p = e;
+	}
+}
+
+template <typename F> static void parallel(uint32_t threads, size_t count, F fn)
+{
+	std::atomic<size_t> next(0);
+	std::vector<std::thread> workers;
+	for (uint32_t i = 0; i < std::min<size_t>(threads, count); i++)
+	{
+		workers.push_back(std::thread([&]()
+		{
+			size_t n;
+			while ((n = next++) < count) fn(n);
+		}));
+	}
+	for (auto &w : workers) w.join();
+}
+
+struct ulgcolumns
+{
+	std::vector<int64_t> time;		// Log time before blocking
+	std::vector<uint32_t> offset;
+	std::vector<uint16_t> raw1, raw2;
+	std::vector<int16_t> mv1, mv2;
+	std::vector<uint8_t> flags;
+	std::vector<int64_t> eventTime;
+	std::vector<uint32_t> eventArg;
+	std::vector<uint8_t> eventType;
+	std::vector<int64_t> blockBase, sessionStart;
+	std::vector<uint64_t> blockRow, sessionRow;
+};
+
+static void place(std::vector<ingchunk> &chunks, ulgcolumns &col)
+{
+	// Sequential pass over the chunks: time base, sessions and flags carried over from the previous chunk
+	int64_t off = 0;
+	uint32_t last = 0;
+	bool timed = false;
+	bool pending = false;
+	uint8_t flags = 0;
+	uint64_t rows = 0, events = 0;
+	col.sessionStart.push_back(0);
+	col.sessionRow.push_back(0);
+	for (auto &c : chunks)
+	{
+		c.row0 = rows;
+		c.event0 = events;
+		c.untimed = off + last;
+		c.inFlags = flags;
+		rows += c.rows.size();
+		events += c.events.size();
+		flags = (c.flags & c.known) | (flags & ~c.known);
+		if (!c.timed)
+		{
+			pending |= c.pending || c.resetFirst;
+			continue;
+		}
+
+		bool reset = timed && (pending || c.resetFirst || c.firstUptime + ING_SLACK < last);
+		c.base = reset ? off + last : off;
+		if (reset)
+		{
+			col.sessionStart.push_back(c.base);
+			col.sessionRow.push_back(c.row0 + c.firstRow);
+		}
+		for (auto &s : c.sessions)
+		{
+			col.sessionStart.push_back(c.base + s.time);
+			col.sessionRow.push_back(c.row0 + s.row);
+		}
+		off = c.base + c.localOff;
+		last = c.lastUptime;
+		timed = true;
+		pending = c.pending;
+	}
+
+	col.time.resize(rows);
+	col.raw1.resize(rows);
+	col.raw2.resize(rows);
+	col.mv1.resize(rows);
+	col.mv2.resize(rows);
+	col.flags.resize(rows);
+	col.eventTime.resize(events);
+	col.eventArg.resize(events);
+	col.eventType.resize(events);
+}
+
+static void fill(const ingchunk &c, ulgcolumns &col)
+{
+	// Resolve chunk local times and flags, clamped so log time never goes backwards
+	for (size_t i = 0; i < c.rows.size(); i++)
+	{
+		const ingrow &r = c.rows[i];
+		size_t n = c.row0 + i;
+		col.time[n] = r.time < 0 ? c.untimed : std::max(c.base + r.time, c.untimed);
+		col.raw1[n] = r.raw1;
+		col.raw2[n] = r.raw2;
+		col.mv1[n] = r.mv1;
+		col.mv2[n] = r.mv2;
+		col.flags[n] = (r.flags & r.known) | (c.inFlags & ~r.known);
+	}
+	for (size_t i = 0; i < c.events.size(); i++)
+	{
+		const ingevent &e = c.events[i];
+		size_t n = c.event0 + i;
+		col.eventTime[n] = e.time < 0 ? c.untimed : std::max(c.base + e.time, c.untimed);
+		col.eventArg[n] = e.arg;
+		col.eventType[n] = e.type;
+	}
+}
+
+static void blocks(ulgcolumns &col)
+{
+	// New block every ULG_BLOCK rows, or earlier if the offset would not fit in 32 bits
+	col.offset.resize(col.time.size());
+	int64_t base = 0;
+	uint64_t first = 0;
+	for (uint64_t i = 0; i < col.time.size(); i++)
+	{
+		if (i == 0 || i - first >= ULG_BLOCK || col.time[i] - base > UINT32_MAX)
+		{
+			base = col.time[i];
+			first = i;
+			col.blockBase.push_back(base);
+			col.blockRow.push_back(i);
+		}
+		col.offset[i] = col.time[i] - base;
+	}
+}
+
+template <typename T> static bool section(FILE *f, ulgheader &h, int sec, const std::vector<T> &v)
+{
+	static const char pad[8] = { 0 };
+	long pos = ftell(f);
+	if (pos % 8 && fwrite(pad, 8 - pos % 8, 1, f) != 1) return false;
+	h.offset[sec] = ftell(f);
+	return v.empty() || fwrite(v.data(), sizeof(T), v.size(), f) == v.size();
+}
+
+static bool write(const char *name, ulgcolumns &col)
+{
+	FILE *f = fopen(name, "wb");
+	if (!f)
+	{
+		perror(name);
+		return false;
+	}
+	ulgheader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, ULG_MAGIC, 4);
+	h.sections = SEC_COUNT;
+	h.rows = col.time.size();
+	h.events = col.eventTime.size();
+	h.blocks = col.blockBase.size();
+	h.sessions = col.sessionStart.size();
+	bool ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+		section(f, h, SEC_BLOCKBASE, col.blockBase) &&
+		section(f, h, SEC_BLOCKROW, col.blockRow) &&
+		section(f, h, SEC_SESSIONSTART, col.sessionStart) &&
+		section(f, h, SEC_SESSIONROW, col.sessionRow) &&
+		section(f, h, SEC_EVENTTIME, col.eventTime) &&
+		section(f, h, SEC_TIME, col.offset) &&
+		section(f, h, SEC_EVENTARG, col.eventArg) &&
+		section(f, h, SEC_RAW1, col.raw1) &&
+		section(f, h, SEC_RAW2, col.raw2) &&
+		section(f, h, SEC_MV1, col.mv1) &&
+		section(f, h, SEC_MV2, col.mv2) &&
+		section(f, h, SEC_FLAGS, col.flags) &&
+		section(f, h, SEC_EVENTTYPE, col.eventType);
+	ok = ok && fseek(f, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, f) == 1;
+	if (fclose(f) != 0) ok = false;
+	if (!ok) perror(name);
+	return ok;
+}
+
+static int ingest(uint32_t threads, const char *out, char **files, int count)
+{
+	auto start = std::chrono::steady_clock::now();
+	std::vector<mapping> maps(count);
+	std::vector<ingchunk> chunks;
+	uint64_t bytes = 0;
+	for (int i = 0; i < count; i++)
+	{
+		if (!mapfile(files[i], maps[i])) return 1;
+		split(maps[i], chunks);
+		bytes += maps[i].size;
+	}
+
+	parallel(threads, chunks.size(), [&](size_t n) { scanner(chunks[n]).run(); });
+	ulgcolumns col;
+	place(chunks, col);
+	parallel(threads, chunks.size(), [&](size_t n) { fill(chunks[n], col); });
+	blocks(col);
+	if (!write(out, col)) return 1;
+
+	for (auto &m : maps) if (m.size) munmap((void *)m.data, m.size);
+	double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	printf("%llu bytes in %zu chunks, %zu rows, %zu events, %zu sessions, %zu blocks\n", (unsigned long long)bytes, chunks.size(),
+		col.time.size(), col.eventTime.size(), col.sessionStart.size(), col.blockBase.size());
+	printf("%.2fs, %.0f MB/s with %u threads\n", secs, bytes / 1e6 / secs, threads);
+	return 0;
+}
+
+// -- Query
+
+class ulgfile
+{
+public:
+	ulgheader h;
+
+	bool open(const char *name)
+	{
+		if (!mapfile(name, m)) return false;
+		if (m.size < sizeof(h)) return bad(name);
+		memcpy(&h, m.data, sizeof(h));
+		if (memcmp(h.magic, ULG_MAGIC, 4) || h.sections != SEC_COUNT) return bad(name);
+		static const uint8_t width[SEC_COUNT] = { 8, 8, 8, 8, 8, 4, 4, 2, 2, 2, 2, 1, 1 };
+		for (int i = 0; i < SEC_COUNT; i++)
+		{
+			uint64_t n = count(i);
+			if (h.offset[i] % 8 || h.offset[i] > m.size || n * width[i] > m.size - h.offset[i]) return bad(name);
+		}
+		if (h.rows && (!h.blocks || !h.sessions)) return bad(name);
+		return true;
+	}
+
+	template <typename T> const T *col(int sec) const
+	{
+		return (const T *)(m.data + h.offset[sec]);
+	}
+
+	int64_t time(uint64_t row, uint64_t block) const
+	{
+		return col<int64_t>(SEC_BLOCKBASE)[block] + col<uint32_t>(SEC_TIME)[row];
+	}
+
+	uint64_t block(uint64_t row) const
+	{
+		const uint64_t *r = col<uint64_t>(SEC_BLOCKROW);
+		return std::upper_bound(r, r + h.blocks, row) - r - 1;
+	}
+
+	uint64_t lower(int64_t t) const
+	{
+		// First row at or after t
+		if (!h.rows) return 0;
+		const int64_t *base = col<int64_t>(SEC_BLOCKBASE);
+		const uint64_t *first = col<uint64_t>(SEC_BLOCKROW);
+		uint64_t b = std::upper_bound(base, base + h.blocks, t) - base;
+		if (b == 0) return 0;
+		b--;
+		uint64_t end = b + 1 < h.blocks ? first[b + 1] : h.rows;
+		const uint32_t *off = col<uint32_t>(SEC_TIME);
+		return std::lower_bound(off + first[b], off + end, (uint64_t)(t - base[b]),
+			[](uint32_t a, uint64_t v) { return a < v; }) - off;
+	}
+
+	uint64_t session(int64_t t) const
+	{
+		const int64_t *s = col<int64_t>(SEC_SESSIONSTART);
+		uint64_t n = std::upper_bound(s, s + h.sessions, t) - s;
+		return n ? n - 1 : 0;
+	}
+
+private:
+	mapping m;
+
+	uint64_t count(int sec) const
+	{
+		switch (sec)
+		{
+			case SEC_BLOCKBASE: case SEC_BLOCKROW: return h.blocks;
+			case SEC_SESSIONSTART: case SEC_SESSIONROW: return h.sessions;
+			case SEC_EVENTTIME: case SEC_EVENTARG: case SEC_EVENTTYPE: return h.events;
+			default: return h.rows;
+		}
+	}
+
+	bool bad(const char *name)
+	{
+		fprintf(stderr, "%s: not a log file or damaged\n", name);
+		return false;
+	}
+};
+
+static int query(const char *name, int64_t from, int64_t to, bool events, bool summary)
+{
+	ulgfile f;
+	if (!f.open(name)) return 1;
+	const int64_t *sessionStart = f.col<int64_t>(SEC_SESSIONSTART);
+
+	if (events)
+	{
+		const int64_t *et = f.col<int64_t>(SEC_EVENTTIME);
+		const uint32_t *arg = f.col<uint32_t>(SEC_EVENTARG);
+		const uint8_t *type = f.col<uint8_t>(SEC_EVENTTYPE);
+		uint64_t first = std::lower_bound(et, et + f.h.events, from) - et;
+		uint64_t counts[EV_COUNT] = { 0 };
+		if (!summary) printf("time,session,uptime,event,arg\n");
+		for (uint64_t i = first; i < f.h.events && et[i] <= to; i++)
+		{
+			uint8_t t = type[i] < EV_COUNT ? type[i] : 0;
+			counts[t]++;
+			if (summary) continue;
+			uint64_t s = f.session(et[i]);
+			printf("%lld,%llu,%lld,%s,%u\n", (long long)et[i], (unsigned long long)s, (long long)(et[i] - sessionStart[s]), eventNames[t], arg[i]);
+		}
+		if (summary) for (int i = 0; i < EV_COUNT; i++) printf("%s: %llu\n", eventNames[i], (unsigned long long)counts[i]);
+		return 0;
+	}
+
+	const uint16_t *raw1 = f.col<uint16_t>(SEC_RAW1), *raw2 = f.col<uint16_t>(SEC_RAW2);
+	const int16_t *mv1 = f.col<int16_t>(SEC_MV1), *mv2 = f.col<int16_t>(SEC_MV2);
+	const uint8_t *flags = f.col<uint8_t>(SEC_FLAGS);
+	const uint64_t *blockRow = f.col<uint64_t>(SEC_BLOCKROW);
+	const uint64_t *sessionRow = f.col<uint64_t>(SEC_SESSIONROW);
+
+	uint64_t first = f.lower(from);
+	uint64_t b = first < f.h.rows ? f.block(first) : 0;
+	uint64_t s = first < f.h.rows ? std::upper_bound(sessionRow, sessionRow + f.h.sessions, first) - sessionRow - 1 : 0;
+	uint64_t n = 0, ext = 0;
+	int64_t lo[2] = { INT16_MAX, INT16_MAX }, hi[2] = { INT16_MIN, INT16_MIN }, sum[2] = { 0, 0 };
+	int64_t t0 = 0, t1 = 0;
+	if (!summary) printf("time,session,uptime,raw1,raw2,v1,v2,ext,out,fan,chg,low,vlow\n");
+	for (uint64_t i = first; i < f.h.rows; i++)
+	{
+		while (b + 1 < f.h.blocks && blockRow[b + 1] <= i) b++;
+		while (s + 1 < f.h.sessions && sessionRow[s + 1] <= i) s++;
+		int64_t t = f.time(i, b);
+		if (t > to) break;
+		if (!n) t0 = t;
+		t1 = t;
+		n++;
+		if (summary)
+		{
+			int16_t v[2] = { mv1[i], mv2[i] };
+			for (int k = 0; k < 2; k++)
+			{
+				lo[k] = std::min<int64_t>(lo[k], v[k]);
+				hi[k] = std::max<int64_t>(hi[k], v[k]);
+				sum[k] += v[k];
+			}
+			ext += flags[i] & FL_EXT ? 1 : 0;
+			continue;
+		}
+		uint8_t fl = flags[i];
+		printf("%lld,%llu,%lld,%u,%u,%d,%d,%u,%u,%u,%u,%u,%u\n", (long long)t, (unsigned long long)s, (long long)(t - sessionStart[s]),
+			raw1[i], raw2[i], mv1[i], mv2[i], !!(fl & FL_EXT), !!(fl & FL_OUT), !!(fl & FL_FAN), !!(fl & FL_CHG), !!(fl & FL_LOW), !!(fl & FL_VLOW));
+	}
+
+	if (summary)
+	{
+		printf("Rows: %llu of %llu, %llu sessions, %llu events\n", (unsigned long long)n, (unsigned long long)f.h.rows,
+			(unsigned long long)f.h.sessions, (unsigned long long)f.h.events);
+		if (!n) return 0;
+		printf("Time: %.1fs .. %.1fs, ext. power in %.1f%% of rows\n", t0 / 1000.0, t1 / 1000.0, 100.0 * ext / n);
+		for (int k = 0; k < 2; k++)
+		{
+			printf("Battery %d: min %lldmV, max %lldmV, mean %lldmV\n", k + 1, (long long)lo[k], (long long)hi[k], (long long)(sum[k] / (int64_t)n));
+		}
+	}
+	return 0;
+}
+
+static void usage()
+{
+	fprintf(stderr,
+		"Usage: logingest ingest [-t threads] -o out.ulg capture.txt [more captures...]\n"
+		"       logingest query file.ulg [options]\n"
+		"  --from S          Start of the range (log time in s)\n"
+		"  --to S            End of the range (log time in s)\n"
+		"  --events          Events instead of samples\n"
+		"  --summary         Counts, min/max/mean instead of CSV rows\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 3) usage();
+
+	if (!strcmp(argv[1], "ingest"))
+	{
+		uint32_t threads = std::max(1u, std::thread::hardware_concurrency());
+		const char *out = NULL;
+		int i = 2;
+		for (; i < argc && argv[i][0] == '-'; i += 2)
+		{
+			if (i + 1 >= argc) usage();
+			if (!strcmp(argv[i], "-t")) threads = std::max(1ul, strtoul(argv[i+1], NULL, 10));
+			else if (!strcmp(argv[i], "-o")) out = argv[i+1];
+			else usage();
+		}
+		if (!out || i >= argc) usage();
+		return ingest(threads, out, argv + i, argc - i);
+	}
+
+	if (!strcmp(argv[1], "query"))
+	{
+		int64_t from = INT64_MIN, to = INT64_MAX;
+		bool events = false, summary = false;
+		for (int i = 3; i < argc; i++)
+		{
+			const char *a = argv[i];
+			if (!strcmp(a, "--events")) events = true;
+			else if (!strcmp(a, "--summary")) summary = true;
+			else if (i + 1 < argc && !strcmp(a, "--from")) from = atof(argv[++i]) * 1000;
+			else if (i + 1 < argc && !strcmp(a, "--to")) to = atof(argv[++i]) * 1000;
+			else usage();
+		}
+		return query(argv[2], from, to, events, summary);
+	}
+
+	usage();
+}
@@ -0,0 +1,590 @@
+/*
+ * Project: 12V DC Uninterruptable Power Supply
+ * File: mbpoll.cpp
+ * Author: Thorin Hopkins (topy at untergrund dot net)
+ * Copyright: (C) 2014 by Thorin Hopkins
+ * License: GNU GPL v3 (see LICENSE.txt)
+ * Web: https://github.com/Topy44/ups
+ */
+
+// Modbus RTU poller for the register map in modbus.h. Polls a block of registers as fast as the
+// link allows and reports throughput, latency percentiles and errors next to the time the frames
+// alone take on the wire at the given baud rate. Also dumps the decoded map, writes configuration
+// registers and runs a protocol self test (exceptions, CRC errors, broadcasts, address changes).
+//
+// Build: g++ -std=c++11 -O2 -pthread -I"../USV Firmware" mbpoll.cpp -o mbpoll
+// Usage: mbpoll (-d device | --loopback) [-b baud] [-a addr] [-r start] [-c count] [-n requests]
+//               [-w reg=value] [--dump] [--selftest]
+//
+// --loopback runs the firmware's protocol code (modbus.cpp) on the host behind a pseudo terminal,
+// with a made up UPS state, so the poller and the protocol can be tested without hardware. The
+// wire time model doesn't apply there, the pty is much faster than any serial line.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "usvfirmware.h"
+#include "battery.h"
+#include "stats.h"
+#include "modbus.h"
+
+// -- Constants
+#define MBP_BAUD 500000			// Firmware default (BAUD in serial.h)
+#define MBP_TIMEOUT 200			// ms per request
+#define MBP_REQUESTS 1000
+
+enum mbresult
+{
+	MBR_OK,
+	MBR_TIMEOUT,
+	MBR_CRC,
+	MBR_EXCEPTION,
+	MBR_BAD,					// Wrong address, function or length
+};
+
+static long long nowus()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// -- Loopback device: the firmware's protocol code on the master side of a pty
+
+#include "modbus.cpp"
+
+static int loopFd = -1;
+static std::atomic<bool> loopStop(false);
+static uint16_t loopHeartbeat = 1000;
+static uint16_t loopWindow = STATS_WINDOW;
+static long long loopStart;
+
+void mb_snapshot(uint16_t *regs)
+{
+	// Something that moves, so dumps and polls show changing values
+	uint32_t up = (nowus() - loopStart) / 1000000;
+	memset(regs, 0, MB_REGS * sizeof(uint16_t));
+	regs[MB_REG_MAGIC] = MB_MAGIC;
+	regs[MB_REG_VERSION] = MB_MAPVERSION;
+	regs[MB_REG_FIRMWARE] = FWVERSION;
+	regs[MB_REG_CHANNELS] = BAT_CHANNELS;
+	regs[MB_REG_UPTIME] = up >> 16;
+	regs[MB_REG_UPTIME+1] = up;
+	regs[MB_REG_STACK] = 412;
+	for (uint8_t i = 0; i < BAT_CHANNELS; i++)
+	{
+		regs[MB_REG_MV+i] = 12600 + (up + i * 7) % 50;
+		regs[MB_REG_RAW+i] = 800 + i;
+		regs[MB_REG_SOC+i] = 95;
+	}
+	regs[MB_REG_HEARTBEAT] = loopHeartbeat;
+	regs[MB_REG_WINDOW] = loopWindow;
+}
+
+uint8_t mb_write(uint16_t reg, uint16_t value, bool apply)
+{
+	// Same checks as the firmware
+	switch (reg)
+	{
+		case MB_REG_HEARTBEAT:
+			if (value < 100) return MB_EXVALUE;
+			if (apply) loopHeartbeat = value;
+			return 0;
+		case MB_REG_WINDOW:
+			if (value < STATS_MINWINDOW) return MB_EXVALUE;
+			if (apply) loopWindow = value;
+			return 0;
+	}
+	return MB_EXADDRESS;
+}
+
+void mb_send(const uint8_t *frame, uint8_t len)
+{
+	if (write(loopFd, frame, len) != len) perror("loopback write");
+}
+
+void mb_mute(bool mute)
+{
+	(void)mute;		// No text output here
+}
+
+static void loopdevice()
+{
+	pollfd p = { loopFd, POLLIN, 0 };
+	uint8_t buf[256];
+	while (!loopStop)
+	{
+		if (poll(&p, 1, 1) > 0)
+		{
+			ssize_t n = read(loopFd, buf, sizeof(buf));
+			for (ssize_t i = 0; i < n; i++) mb_receive(buf[i], nowus() / 1000);
+		}
+		mb_check(nowus() / 1000);
+	}
+}
+
+static const char *loopopen()
+{
+	// Returns the slave device for the poller
+	loopFd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (loopFd < 0 || grantpt(loopFd) || unlockpt(loopFd)) return NULL;
+	loopStart = nowus();
+	return ptsname(loopFd);
+}
+
+// -- Poller
+
+static speed_t baudflag(uint32_t baud)
+{
+	switch (baud)
+	{
+		case 9600: return B9600;
+		case 19200: return B19200;
+		case 38400: return B38400;
+		case 57600: return B57600;
+		case 115200: return B115200;
+		case 230400: return B230400;
+		case 460800: return B460800;
+		case 500000: return B500000;
+		case 921600: return B921600;
+		case 1000000: return B1000000;
+	}
+	return 0;
+}
+
+static int portopen(const char *dev, uint32_t baud)
+{
+	int fd = open(dev, O_RDWR | O_NOCTTY);
+	if (fd < 0)
+	{
+		perror(dev);
+		return -1;
+	}
+	termios t;
+	if (tcgetattr(fd, &t))
+	{
+		perror(dev);
+		close(fd);
+		return -1;
+	}
+	cfmakeraw(&t);
+	t.c_cflag |= CLOCAL | CREAD;
+	t.c_cflag &= ~(CSTOPB | PARENB | CRTSCTS);
+	t.c_cc[VMIN] = 0;
+	t.c_cc[VTIME] = 0;
+	cfsetispeed(&t, baudflag(baud));
+	cfsetospeed(&t, baudflag(baud));
+	if (tcsetattr(fd, TCSANOW, &t))
+	{
+		perror(dev);
+		close(fd);
+		return -1;
+	}
+	tcflush(fd, TCIOFLUSH);
+	return fd;
+}
+
+static int readn(int fd, uint8_t *buf, int n, long long deadline)
+{
+	// Reads n bytes unless the deadline (us) passes first, returns the count read
+	int got = 0;
+	pollfd p = { fd, POLLIN, 0 };
+	while (got < n)
+	{
+		long long left = deadline - nowus();
+		if (left <= 0 || poll(&p, 1, (left + 999) / 1000) <= 0) break;
+		ssize_t r = read(fd, buf + got, n - got);
+		if (r < 0) break;
+		got += r;
+	}
+	return got;
+}
+
+static void drain(int fd)
+{
+	// After an error: let a late or partial reply run out, then start clean
+	usleep(MB_GAP * 2000);
+	tcflush(fd, TCIFLUSH);
+}
+
+static mbresult transact(int fd, uint8_t *req, uint8_t len, uint8_t *resp, int *rlen, uint8_t *ex, int timeout)
+{
+	// req needs room for the CRC. Broadcasts time out, as they should.
+	uint16_t crc = mb_crc(req, len);
+	req[len] = crc;
+	req[len+1] = crc >> 8;
+	if (write(fd, req, len + 2) != len + 2) return MBR_BAD;
+
+	long long deadline = nowus() + timeout * 1000LL;
+	*rlen = 0;
+	int n = readn(fd, resp, 2, deadline);
+	*rlen = n;
+	if (n < 2) return MBR_TIMEOUT;
+	if (resp[0] != req[0] || (resp[1] & 0x7F) != req[1]) return MBR_BAD;
+
+	int need;
+	if (resp[1] & 0x80) need = 3;
+	else if (req[1] == MB_READHOLDING || req[1] == MB_READINPUT)
+	{
+		if (readn(fd, resp + 2, 1, deadline) < 1) return MBR_TIMEOUT;
+		*rlen = 3;
+		need = resp[2] + 2;
+	}
+	else need = 6;
+	n = readn(fd, resp + *rlen, need, deadline);
+	*rlen += n;
+	if (n < need) return MBR_TIMEOUT;
+
+	crc = mb_crc(resp, *rlen - 2);
+	if (resp[*rlen - 2] != (uint8_t)crc || resp[*rlen - 1] != crc >> 8) return MBR_CRC;
+	if (resp[1] & 0x80)
+	{
+		*ex = resp[2];
+		return MBR_EXCEPTION;
+	}
+	return MBR_OK;
+}
+
+static mbresult readregs(int fd, uint8_t addr, uint16_t start, uint16_t count, uint16_t *regs, uint8_t *ex, int timeout)
+{
+	uint8_t req[8] = { addr, MB_READHOLDING, (uint8_t)(start >> 8), (uint8_t)start, (uint8_t)(count >> 8), (uint8_t)count };
+	uint8_t resp[5 + 2 * MB_MAXREAD + 2];
+	int rlen;
+	mbresult r = transact(fd, req, 6, resp, &rlen, ex, timeout);
+	if (r != MBR_OK) return r;
+	if (resp[2] != count * 2) return MBR_BAD;
+	for (uint16_t i = 0; i < count; i++) regs[i] = resp[3 + 2*i] << 8 | resp[4 + 2*i];
+	return MBR_OK;
+}
+
+static mbresult writeregs(int fd, uint8_t addr, uint16_t start, const uint16_t *values, uint16_t count, uint8_t *ex, int timeout)
+{
+	// Single register write for one value, multiple for more
+	uint8_t req[9 + 2 * MB_MAXREAD + 2] = { addr, MB_WRITESINGLE, (uint8_t)(start >> 8), (uint8_t)start };
+	uint8_t len;
+	if (count == 1)
+	{
+		req[4] = values[0] >> 8;
+		req[5] = values[0];
+		len = 6;
+	}
+	else
+	{
+		req[1] = MB_WRITEMULTIPLE;
+		req[4] = count >> 8;
+		req[5] = count;
+		req[6] = count * 2;
+		for (uint16_t i = 0; i < count; i++)
+		{
+			req[7 + 2*i] = values[i] >> 8;
+			req[8 + 2*i] = values[i];
+		}
+		len = 7 + count * 2;
+	}
+	uint8_t resp[16];
+	int rlen;
+	mbresult r = transact(fd, req, len, resp, &rlen, ex, timeout);
+	if (r == MBR_OK && memcmp(resp, req, 6)) return MBR_BAD;	// Echo of the request header
+	return r;
+}
+
+static const char *resultname(mbresult r)
+{
+	static const char *names[] = { "ok", "timeout", "crc", "exception", "bad" };
+	return names[r];
+}
+
+// -- Benchmark
+
+static int bench(int fd, uint8_t addr, uint16_t start, uint16_t count, int requests, uint32_t baud, bool loopback)
+{
+	std::vector<long long> lat;
+	int errors[MBR_BAD + 1] = {};
+	uint16_t regs[MB_MAXREAD];
+
+	long long t0 = nowus();
+	for (int i = 0; i < requests; i++)
+	{
+		uint8_t ex = 0;
+		long long t = nowus();
+		mbresult r = readregs(fd, addr, start, count, regs, &ex, MBP_TIMEOUT);
+		if (r == MBR_OK) lat.push_back(nowus() - t);
+		else
+		{
+			errors[r]++;
+			drain(fd);
+		}
+	}
+	double secs = (nowus() - t0) / 1e6;
+
+	printf("Requests: %d of %u registers from %u, %d ok, %d timeout, %d crc, %d exception, %d bad\n", requests, count, start,
+		(int)lat.size(), errors[MBR_TIMEOUT], errors[MBR_CRC], errors[MBR_EXCEPTION], errors[MBR_BAD]);
+	printf("Throughput: %.0f requests/s, %.0f registers/s\n", requests / secs, lat.size() * count / secs);
+	if (!lat.empty())
+	{
+		std::sort(lat.begin(), lat.end());
+		printf("Latency (us): min %lld, median %lld, p99 %lld, max %lld\n", lat.front(), lat[lat.size() / 2],
+			lat[std::min(lat.size() - 1, lat.size() * 99 / 100)], lat.back());
+	}
+
+	// Request 8 bytes, response 5 + 2 per register, 10 bits per byte
+	double wire = (8 + 5 + 2 * count) * 10.0 / baud;
+	printf("Wire time at %u baud: %.0f us per request, %.0f requests/s at most%s\n", baud, wire * 1e6, 1 / wire,
+		loopback ? " (not modelled by the loopback)" : "");
+	return lat.size() == (size_t)requests ? 0 : 1;
+}
+
+// -- Map dump
+
+static void dump(const uint16_t *regs)
+{
+	static const struct { uint8_t reg; bool wide; const char *name; } names[] =
+	{
+		{ MB_REG_MAGIC, false, "magic" }, { MB_REG_VERSION, false, "version" }, { MB_REG_FIRMWARE, false, "firmware" },
+		{ MB_REG_CHANNELS, false, "channels" }, { MB_REG_FLAGS, false, "flags" }, { MB_REG_ALARMS, false, "alarms" },
+		{ MB_REG_UPTIME, true, "uptime" }, { MB_REG_CHARGESTATE, false, "chargestate" }, { MB_REG_CHARGING, false, "charging" },
+		{ MB_REG_CHARGEETA, false, "chargeeta" }, { MB_REG_RESTARTS, false, "restarts" }, { MB_REG_FANDUTY, false, "fanduty" },
+		{ MB_REG_FANREMAIN, false, "fanremain" }, { MB_REG_ADCPOLICY, false, "adcpolicy" }, { MB_REG_STACK, false, "stack" },
+		{ MB_REG_OUTAGES, false, "outages" }, { MB_REG_OUTAGETIME, true, "outagetime" }, { MB_REG_LONGEST, true, "longest" },
+		{ MB_REG_BATTERYTIME, true, "batterytime" }, { MB_REG_DROPS, false, "drops" }, { MB_REG_TIMEOUTS, false, "timeouts" },
+		{ MB_REG_FRAMES, false, "frames" }, { MB_REG_ADDRESS, false, "address" }, { MB_REG_IDLE, false, "idle" },
+		{ MB_REG_HEARTBEAT, false, "heartbeat" }, { MB_REG_WINDOW, false, "window" },
+	};
+	for (auto &n : names)
+	{
+		uint32_t v = n.wide ? (uint32_t)regs[n.reg] << 16 | regs[n.reg + 1] : regs[n.reg];
+		bool hex = n.reg == MB_REG_MAGIC || n.reg == MB_REG_FIRMWARE || n.reg == MB_REG_FLAGS;
+		printf(hex ? "%3u %-12s 0x%04X\n" : "%3u %-12s %u\n", n.reg, n.name, v);
+	}
+	uint16_t channels = std::min<uint16_t>(regs[MB_REG_CHANNELS], MB_MAXCHANNELS);
+	for (uint16_t i = 0; i < channels; i++)
+	{
+		printf("%3u mv%-10u %d\n", MB_REG_MV + i, i + 1, (int16_t)regs[MB_REG_MV + i]);
+		printf("%3u raw%-9u %u\n", MB_REG_RAW + i, i + 1, regs[MB_REG_RAW + i]);
+		printf("%3u soc%-9u %u\n", MB_REG_SOC + i, i + 1, regs[MB_REG_SOC + i]);
+		printf("%3u rate%-8u %d\n", MB_REG_RATE + i, i + 1, (int16_t)regs[MB_REG_RATE + i]);
+	}
+	static const char *relays[] = { "charge", "source1", "source2" };
+	for (uint16_t i = 0; i < 3; i++)
+	{
+		printf("%3u ops.%-8s %u\n", MB_REG_RELAYOPS + i, relays[i], regs[MB_REG_RELAYOPS + i]);
+		printf("%3u max.%-8s %u\n", MB_REG_RELAYMAX + i, relays[i], regs[MB_REG_RELAYMAX + i]);
+	}
+}
+
+// -- Self test
+
+static int testFailed;
+
+static void check(bool ok, const char *what)
+{
+	printf("%-48s %s\n", what, ok ? "ok" : "FAIL");
+	if (!ok) testFailed++;
+}
+
+static mbresult rawrequest(int fd, const uint8_t *frame, uint8_t len, uint8_t *ex, int timeout)
+{
+	// Arbitrary frame, CRC appended
+	uint8_t req[64], resp[300];
+	int rlen;
+	memcpy(req, frame, len);
+	return transact(fd, req, len, resp, &rlen, ex, timeout);
+}
+
+static int selftest(int fd, uint8_t addr)
+{
+	// Leaves the configuration as it found it
+	uint16_t regs[MB_REGS], v[2];
+	uint8_t ex = 0;
+	int quiet = MB_GAP * 5;		// ms to wait for a reply that shouldn't come
+
+	bool ok = readregs(fd, addr, 0, MB_REGS, regs, &ex, MBP_TIMEOUT) == MBR_OK;
+	check(ok && regs[MB_REG_MAGIC] == MB_MAGIC && regs[MB_REG_VERSION] == MB_MAPVERSION, "read whole map, magic and version");
+	if (!ok) return 1;
+	uint16_t heartbeat = regs[MB_REG_HEARTBEAT], window = regs[MB_REG_WINDOW], idle = regs[MB_REG_IDLE];
+	uint16_t frames = regs[MB_REG_FRAMES];
+
+	check(readregs(fd, addr, 0, 1, regs, &ex, MBP_TIMEOUT) == MBR_OK && readregs(fd, addr, MB_REG_FRAMES, 1, regs, &ex, MBP_TIMEOUT) == MBR_OK
+		&& regs[0] == frames + 2, "frame counter");
+	check(readregs(fd, addr, 0, 0, regs, &ex, MBP_TIMEOUT) == MBR_EXCEPTION && ex == MB_EXVALUE, "read of 0 registers: exception 03");
+	check(readregs(fd, addr, MB_REGS - 4, 8, regs, &ex, MBP_TIMEOUT) == MBR_EXCEPTION && ex == MB_EXADDRESS, "read past the map: exception 02");
+
+	uint8_t input[] = { addr, MB_READINPUT, 0, 0, 0, 2 };
+	check(rawrequest(fd, input, 6, &ex, MBP_TIMEOUT) == MBR_OK, "read input registers");
+
+	uint8_t badcrc[] = { addr, MB_READHOLDING, 0, 0, 0, 1, 0x12, 0x34 };
+	if (write(fd, badcrc, 8) != 8) return 1;
+	uint8_t resp[8];
+	check(readn(fd, resp, 1, nowus() + quiet * 1000LL) == 0, "bad CRC: no reply");
+
+	uint8_t unknown[] = { addr, 0x2B, 0x0E, 0x01, 0x00 };
+	check(rawrequest(fd, unknown, 5, &ex, MBP_TIMEOUT) == MBR_EXCEPTION && ex == MB_EXFUNCTION, "unknown function: exception 01");
+
+	v[0] = 1;
+	check(writeregs(fd, addr, MB_REG_FLAGS, v, 1, &ex, MBP_TIMEOUT) == MBR_EXCEPTION && ex == MB_EXADDRESS, "write of a read only register: exception 02");
+	v[0] = 50;
+	check(writeregs(fd, addr, MB_REG_HEARTBEAT, v, 1, &ex, MBP_TIMEOUT) == MBR_EXCEPTION && ex == MB_EXVALUE, "heartbeat below 100ms: exception 03");
+	v[0] = 2000;
+	check(writeregs(fd, addr, MB_REG_HEARTBEAT, v, 1, &ex, MBP_TIMEOUT) == MBR_OK
+		&& readregs(fd, addr, MB_REG_HEARTBEAT, 1, regs, &ex, MBP_TIMEOUT) == MBR_OK && regs[0] == 2000, "write single register, read back");
+
+	v[0] = 1000;
+	v[1] = 10;
+	check(writeregs(fd, addr, MB_REG_HEARTBEAT, v, 2, &ex, MBP_TIMEOUT) == MBR_EXCEPTION && ex == MB_EXVALUE
+		&& readregs(fd, addr, MB_REG_HEARTBEAT, 1, regs, &ex, MBP_TIMEOUT) == MBR_OK && regs[0] == 2000, "write multiple, one invalid: none applied");
+	v[1] = 5000;
+	check(writeregs(fd, addr, MB_REG_HEARTBEAT, v, 2, &ex, MBP_TIMEOUT) == MBR_OK
+		&& readregs(fd, addr, MB_REG_HEARTBEAT, 2, regs, &ex, MBP_TIMEOUT) == MBR_OK && regs[0] == 1000 && regs[1] == 5000, "write multiple registers, read back");
+
+	uint8_t other = addr;
+	do other = other % MB_MAXADDRESS + 1; while (!mbaddressok(other));
+	check(readregs(fd, other, 0, 1, regs, &ex, quiet) == MBR_TIMEOUT, "other address: no reply");
+	v[0] = 6000;
+	check(writeregs(fd, 0, MB_REG_WINDOW, v, 1, &ex, quiet) == MBR_TIMEOUT
+		&& readregs(fd, addr, MB_REG_WINDOW, 1, regs, &ex, MBP_TIMEOUT) == MBR_OK && regs[0] == 6000, "broadcast write: no reply, applied");
+
+	v[0] = other;
+	check(writeregs(fd, addr, MB_REG_ADDRESS, v, 1, &ex, MBP_TIMEOUT) == MBR_OK
+		&& readregs(fd, other, MB_REG_ADDRESS, 1, regs, &ex, MBP_TIMEOUT) == MBR_OK && regs[0] == other
+		&& readregs(fd, addr, 0, 1, regs, &ex, quiet) == MBR_TIMEOUT, "change slave address");
+	v[0] = 0x30;
+	check(writeregs(fd, other, MB_REG_ADDRESS, v, 1, &ex, MBP_TIMEOUT) == MBR_EXCEPTION && ex == MB_EXVALUE, "address 0x30, taken for text: exception 03");
+	v[0] = '\r';
+	check(writeregs(fd, other, MB_REG_ADDRESS, v, 1, &ex, MBP_TIMEOUT) == MBR_EXCEPTION && ex == MB_EXVALUE, "address 13 (CR): exception 03");
+
+	// Back to text after the idle time, the address has to start a frame again
+	v[0] = 1;
+	check(writeregs(fd, other, MB_REG_IDLE, v, 1, &ex, MBP_TIMEOUT) == MBR_OK, "idle time 1s");
+	usleep(1500000);
+	check(readregs(fd, other, MB_REG_ADDRESS, 1, regs, &ex, MBP_TIMEOUT) == MBR_OK && regs[0] == other, "poll after the idle time");
+	v[0] = idle;
+	check(writeregs(fd, other, MB_REG_IDLE, v, 1, &ex, MBP_TIMEOUT) == MBR_OK, "restore idle time");
+
+	v[0] = addr;
+	check(writeregs(fd, other, MB_REG_ADDRESS, v, 1, &ex, MBP_TIMEOUT) == MBR_OK, "change it back");
+
+	v[0] = heartbeat;
+	v[1] = window;
+	check(writeregs(fd, addr, MB_REG_HEARTBEAT, v, 2, &ex, MBP_TIMEOUT) == MBR_OK, "restore configuration");
+
+	printf("%s\n", testFailed ? "Self test FAILED" : "Self test passed");
+	return testFailed ? 1 : 0;
+}
+
+static void usage()
+{
+	fprintf(stderr,
+		"Usage: mbpoll [options]\n"
+		"  -d DEVICE         Serial port\n"
+		"  --loopback        Poll the protocol code on the host instead\n"
+		"  -b BAUD           Baud rate (500000)\n"
+		"  -a ADDR           Slave address (1)\n"
+		"  -r REG            First register to poll (0)\n"
+		"  -c N              Registers per request (all)\n"
+		"  -n N              Requests (1000)\n"
+		"  -w REG=VALUE      Write a register first (repeatable)\n"
+		"  --dump            Print the decoded register map and exit\n"
+		"  --selftest        Check protocol handling and exit\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *dev = NULL;
+	bool loopback = false, dumpmap = false, test = false;
+	uint32_t baud = MBP_BAUD;
+	unsigned addr = MB_ADDRESS, start = 0, count = MB_REGS;
+	int requests = MBP_REQUESTS;
+	std::vector<std::pair<unsigned, unsigned>> writes;
+
+	for (int i = 1; i < argc; i++)
+	{
+		const char *a = argv[i];
+		if (!strcmp(a, "--loopback")) loopback = true;
+		else if (!strcmp(a, "--dump")) dumpmap = true;
+		else if (!strcmp(a, "--selftest")) test = true;
+		else if (i + 1 < argc)
+		{
+			const char *v = argv[++i];
+			if (!strcmp(a, "-d")) dev = v;
+			else if (!strcmp(a, "-b")) baud = strtoul(v, NULL, 10);
+			else if (!strcmp(a, "-a")) addr = strtoul(v, NULL, 10);
+			else if (!strcmp(a, "-r")) start = strtoul(v, NULL, 10);
+			else if (!strcmp(a, "-c")) count = strtoul(v, NULL, 10);
+			else if (!strcmp(a, "-n")) requests = atoi(v);
+			else if (!strcmp(a, "-w"))
+			{
+				unsigned reg, value;
+				if (sscanf(v, "%u=%u", &reg, &value) != 2) usage();
+				writes.push_back(std::make_pair(reg, value));
+			}
+			else usage();
+		}
+		else usage();
+	}
+	if (!dev == !loopback || !mbaddressok(addr) || count < 1 || count > MB_MAXREAD || requests < 1) usage();
+	if (!baudflag(baud))
+	{
+		fprintf(stderr, "Baud rate %u not supported by termios\n", baud);
+		return 1;
+	}
+
+	std::thread device;
+	if (loopback)
+	{
+		dev = loopopen();
+		if (!dev)
+		{
+			perror("pty");
+			return 1;
+		}
+	}
+	int fd = portopen(dev, baud);
+	if (fd < 0) return 1;
+	if (loopback) device = std::thread(loopdevice);
+
+	int ret = 0;
+	for (auto &w : writes)
+	{
+		uint16_t v = w.second;
+		uint8_t ex = 0;
+		mbresult r = writeregs(fd, addr, w.first, &v, 1, &ex, MBP_TIMEOUT);
+		if (r == MBR_EXCEPTION) fprintf(stderr, "Write %u=%u: exception %02X\n", w.first, w.second, ex);
+		else if (r != MBR_OK) fprintf(stderr, "Write %u=%u: %s\n", w.first, w.second, resultname(r));
+		if (r != MBR_OK) ret = 1;
+	}
+
+	if (ret) ;
+	else if (test) ret = selftest(fd, addr);
+	else if (dumpmap)
+	{
+		uint16_t regs[MB_REGS];
+		uint8_t ex = 0;
+		mbresult r = readregs(fd, addr, 0, MB_REGS, regs, &ex, MBP_TIMEOUT);
+		if (r == MBR_OK && regs[MB_REG_MAGIC] == MB_MAGIC) dump(regs);
+		else
+		{
+			fprintf(stderr, "Read failed: %s\n", r == MBR_OK ? "not a UPS register map" : resultname(r));
+			ret = 1;
+		}
+	}
+	else ret = bench(fd, addr, start, count, requests, baud, loopback);
+
+	if (loopback)
+	{
+		loopStop = true;
+		device.join();
+	}
+	close(fd);
+	return ret;
+}
@@ -0,0 +1,61 @@
+#!/bin/sh
+#
+# Project: 12V DC Uninterruptable Power Supply
+# File: memreport.sh
+# Author: Thorin Hopkins (topy at untergrund dot net)
+# Copyright: (C) 2014 by Thorin Hopkins
+# License: GNU GPL v3 (see LICENSE.txt)
+# Web: https://github.com/Topy44/ups
+#
+# Report flash, SRAM and static stack headroom of a firmware image.
+#
+# Usage: memreport.sh firmware.elf [baseline.elf]
+#
+# With a baseline image the differences are printed as well. The measured
+# stack high water mark is reported by the firmware itself in its status
+# output ("Stack headroom: n bytes").
+
+FLASHSIZE=32768
+RAMSIZE=2048
+
+SIZE=${AVRSIZE:-avr-size}
+NM=${AVRNM:-avr-nm}
+
+if [ -z "$1" ]; then
+	echo "Usage: $0 firmware.elf [baseline.elf]" >&2
+	exit 1
+fi
+
+# Print "text data bss" for an image
+sections()
+{
+	$SIZE -A "$1" | awk '
+		$1 == ".text" { text = $2 }
+		$1 == ".data" { data = $2 }
+		$1 == ".bss" { bss += $2 }
+		$1 == ".noinit" { bss += $2 }
+		END { print text + 0, data + 0, bss + 0 }'
+}
+
+report()
+{
+	set -- $(sections "$1") "$1"
+	flash=$(($1 + $2))
+	ram=$(($2 + $3))
+	echo "$4:"
+	printf "  Flash: %6d bytes (%d%% of %d)\n" $flash $((flash * 100 / FLASHSIZE)) $FLASHSIZE
+	printf "  SRAM:  %6d bytes (%d%% of %d) - .data %d, .bss/.noinit %d\n" $ram $((ram * 100 / RAMSIZE)) $RAMSIZE $2 $3
+	printf "  Stack headroom (static): %d bytes\n" $((RAMSIZE - ram))
+}
+
+report "$1"
+echo "  Largest SRAM users:"
+$NM --size-sort -S -C --radix=d "$1" | awk '$3 ~ /^[bBdD]$/ { printf "    %6d  %s\n", $2, $4 }' | sort -rn | head -10
+
+if [ -n "$2" ]; then
+	report "$2"
+	set -- $(sections "$1") $(sections "$2")
+	echo "Difference (image - baseline):"
+	printf "  Flash: %+d bytes\n" $(($1 + $2 - $4 - $5))
+	printf "  SRAM:  %+d bytes\n" $(($2 + $3 - $5 - $6))
+fi
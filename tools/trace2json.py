@@ -0,0 +1,157 @@
+#!/usr/bin/env python3
+#
+# Project: 12V DC Uninterruptable Power Supply
+# File: trace2json.py
+# Author: Thorin Hopkins (topy at untergrund dot net)
+# Copyright: (C) 2014 by Thorin Hopkins
+# License: GNU GPL v3 (see LICENSE.txt)
+# Web: https://github.com/Topy44/ups
+#
+# Convert "trace" command dumps from a serial capture to Chrome trace JSON
+# (chrome://tracing, https://ui.perfetto.dev).
+#
+# Usage: trace2json.py capture.txt [more captures...] > trace.json
+#
+# Records carry a 16 bit timestamp in 1/8 ms. They are unwrapped backwards
+# from the time in the dump header. Several dumps are merged into one
+# timeline, records seen in more than one dump are only emitted once.
+
+import argparse
+import json
+import re
+import sys
+
+TICKS_PER_MS = 8
+
+EVENTS = {
+    0x01: "Tick",
+    0x02: "Boot",
+    0x03: "INT0",
+    0x04: "INT0 end",
+    0x05: "RX",
+    0x06: "TX idle",
+    0x07: "Relay",
+    0x08: "Mech. switch",
+    0x09: "Ext. power on",
+    0x0A: "Fan run",
+    0x0B: "Fan stop",
+    0x0C: "Fan duty",
+    0x0D: "LEDs",
+    0x0E: "Charge",
+    0x0F: "Battery critical",
+    0x10: "Status report",
+}
+
+RELAYS = {0: "CHARGESEL", 1: "SOURCESEL1", 2: "SOURCESEL2"}
+CHARGE = {0: "stop", 1: "start", 2: "charger restart", 3: "complete"}
+
+# Track (tid) per kind of event
+TID_ISR, TID_UART, TID_RELAY, TID_MAIN, TID_FAN, TID_LED = range(1, 7)
+TRACKS = {
+    TID_ISR: "INT0 ISR",
+    TID_UART: "UART",
+    TID_RELAY: "Relays",
+    TID_MAIN: "Main loop",
+    TID_FAN: "Fan",
+    TID_LED: "LEDs",
+}
+
+HEADER = re.compile(r"TRACE (\d+) (\d+) (\d+)")
+RECORD = re.compile(r"^[0-9a-fA-F]{8}$")
+
+
+def parse_dumps(lines):
+    """Yield lists of (absolute ticks, event, arg) per dump."""
+    dump = None
+    for line in lines:
+        line = line.strip()
+        if line == "TRACE END":
+            if dump is not None:
+                yield unwrap(*dump)
+            dump = None
+            continue
+        m = HEADER.fullmatch(line)
+        if m:
+            dump = (int(m.group(1)), int(m.group(2)), [])
+            continue
+        if dump is None:
+            continue
+        for word in line.split():
+            if RECORD.match(word):
+                value = int(word, 16)
+                dump[2].append((value >> 16, (value >> 8) & 0xFF, value & 0xFF))
+
+
+def unwrap(now_ms, now_ticks, records):
+    result = []
+    prev_raw = now_ticks
+    prev_abs = now_ms * TICKS_PER_MS + (now_ticks % TICKS_PER_MS)
+    for raw, event, arg in reversed(records):
+        prev_abs -= (prev_raw - raw) & 0xFFFF
+        prev_raw = raw
+        result.append((prev_abs, event, arg))
+    result.reverse()
+    return result
+
+
+def to_chrome(records):
+    events = [
+        {"ph": "M", "pid": 1, "tid": tid, "name": "thread_name", "args": {"name": name}}
+        for tid, name in TRACKS.items()
+    ]
+    events.append({"ph": "M", "pid": 1, "name": "process_name", "args": {"name": "12V USV"}})
+
+    for ticks, event, arg in records:
+        ts = ticks * 1000.0 / TICKS_PER_MS
+        name = EVENTS.get(event, "Event 0x%02x" % event)
+        base = {"pid": 1, "ts": ts, "name": name}
+
+        if event == 0x03:
+            events.append(dict(base, ph="B", tid=TID_ISR, name="INT0", args={"opto": arg}))
+        elif event == 0x04:
+            events.append(dict(base, ph="E", tid=TID_ISR, name="INT0"))
+        elif event in (0x05, 0x06):
+            args = {"byte": "0x%02x" % arg} if event == 0x05 else {}
+            events.append(dict(base, ph="i", s="t", tid=TID_UART, args=args))
+        elif event == 0x07:
+            relay = RELAYS.get(arg >> 1, "relay %d" % (arg >> 1))
+            events.append(dict(base, ph="C", tid=TID_RELAY, name=relay, args={"on": arg & 1}))
+            events.append(dict(base, ph="i", s="t", tid=TID_RELAY, name="%s %s" % (relay, "on" if arg & 1 else "off")))
+        elif event == 0x0C:
+            events.append(dict(base, ph="C", tid=TID_FAN, args={"duty": arg}))
+        elif event in (0x0A, 0x0B):
+            args = {"minutes": arg} if event == 0x0A else {}
+            events.append(dict(base, ph="i", s="t", tid=TID_FAN, args=args))
+        elif event == 0x0D:
+            events.append(dict(base, ph="i", s="t", tid=TID_LED, args={"a": arg >> 4, "b": arg & 0x0F}))
+        elif event == 0x0E:
+            events.append(dict(base, ph="i", s="p", tid=TID_MAIN, name="Charge " + CHARGE.get(arg, str(arg))))
+        elif event == 0x01:
+            continue
+        else:
+            events.append(dict(base, ph="i", s="p", tid=TID_MAIN, args={"arg": arg}))
+
+    return {"traceEvents": events, "displayTimeUnit": "ms"}
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Convert firmware trace dumps to Chrome trace JSON")
+    parser.add_argument("captures", nargs="*", help="serial capture files (default: stdin)")
+    args = parser.parse_args()
+
+    merged = set()
+    if args.captures:
+        for path in args.captures:
+            with open(path, errors="replace") as f:
+                for dump in parse_dumps(f):
+                    merged.update(dump)
+    else:
+        for dump in parse_dumps(sys.stdin):
+            merged.update(dump)
+
+    json.dump(to_chrome(sorted(merged)), sys.stdout, indent=1)
+    sys.stdout.write("\n")
+
+
+if __name__ == "__main__":
+    main()